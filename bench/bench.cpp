@@ -0,0 +1,322 @@
+#include "FAT12.h"
+#include "exceptions.h"
+#include "ThreadPool.h"
+#include <iostream>
+#include <filesystem>
+#include <functional>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <thread>
+#include <exception>
+#include <stdexcept>
+
+// Benchmarks for the FAT12 hot paths. Prints one JSON object per line so results can be compared across commits.
+
+using Path = std::filesystem::path;
+
+const Path imagePath = std::filesystem::temp_directory_path() / "fat12-bench.img";
+const int blockSizes[] = {512, 1024, 2048, 4096};
+
+struct Parameters {
+    int blockSize;
+    size_t size = 0;
+    size_t threads = 0;
+};
+
+void report(const std::string& name, const Parameters& parameters, size_t ops, size_t bytes, double seconds, const Disk::Stats& io) {
+    std::cout << "{\"benchmark\":\"" << name << "\"";
+    std::cout << ",\"block_size\":" << parameters.blockSize;
+    if (parameters.size > 0) {
+        std::cout << ",\"size\":" << parameters.size;
+    }
+    if (parameters.threads > 0) {
+        std::cout << ",\"threads\":" << parameters.threads;
+    }
+    std::cout << ",\"ops\":" << ops;
+    std::cout << ",\"seconds\":" << seconds;
+    std::cout << ",\"ops_per_s\":" << ops / seconds;
+    if (bytes > 0) {
+        std::cout << ",\"mb_per_s\":" << bytes / seconds / (1024 * 1024);
+    }
+    std::cout << ",\"sector_reads_per_op\":" << (double)io.sectorsRead / ops;
+    std::cout << ",\"sector_writes_per_op\":" << (double)io.sectorsWritten / ops;
+    std::cout << ",\"reads_per_op\":" << (double)io.reads.calls / ops;
+    std::cout << ",\"writes_per_op\":" << (double)io.writes.calls / ops;
+    std::cout << ",\"advises_per_op\":" << (double)io.advises.calls / ops;
+    std::cout << "}" << std::endl;
+}
+
+// Runs op ops times on each of threadCount threads and reports the time and disk I/O of the whole run.
+void measure(FAT12& fs, const std::string& name, const Parameters& parameters, size_t ops, size_t bytesPerOp, const std::function<void(size_t)>& op, size_t threadCount = 1) {
+    auto before = fs.stats().disk;
+    auto start = std::chrono::steady_clock::now();
+
+    // An error escaping a thread would terminate the process, so each thread keeps its own and the first is
+    // rethrown once all have joined.
+    std::vector<std::thread> threads;
+    std::vector<std::exception_ptr> errors(threadCount);
+    for (size_t thread = 0; thread < threadCount; thread++) {
+        threads.emplace_back([&, thread]() {
+            try {
+                for (size_t i = thread * ops; i < (thread + 1) * ops; i++) {
+                    op(i);
+                }
+            } catch (...) {
+                errors[thread] = std::current_exception();
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    for (auto& error : errors) {
+        if (error) {
+            try {
+                std::rethrow_exception(error);
+            } catch (const std::exception& e) {
+                throw std::runtime_error(name + ": " + e.what());
+            }
+        }
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    auto after = fs.stats().disk;
+    Disk::Stats io = {
+        .reads = {after.reads.calls - before.reads.calls, after.reads.time - before.reads.time},
+        .writes = {after.writes.calls - before.writes.calls, after.writes.time - before.writes.time},
+        .advises = {after.advises.calls - before.advises.calls, after.advises.time - before.advises.time},
+        .sectorsRead = after.sectorsRead - before.sectorsRead,
+        .sectorsWritten = after.sectorsWritten - before.sectorsWritten
+    };
+
+    report(name, parameters, ops * threadCount, bytesPerOp * ops * threadCount, elapsed.count(), io);
+}
+
+std::vector<char> randomData(size_t size) {
+    static std::mt19937 rng(1);
+    std::vector<char> data(size);
+    for (auto& c : data) {
+        c = rng();
+    }
+    return data;
+}
+
+void benchCreateDirectory(int blockSize) {
+    FAT12 fs(imagePath, blockSize);
+    fs.createDirectory("/d");
+
+    measure(fs, "createDirectory", {blockSize}, 200, 0, [&](size_t i) {
+        fs.createDirectory("/d/" + std::to_string(i));
+    });
+}
+
+void benchFiles(int blockSize, size_t size) {
+    // Fewer large files, with an image big enough for them and their appends.
+    size_t fileCount = size < 1024 * 1024 ? 50 : 8;
+    size_t blockCount = std::max(FAT12::defaultBlockCount, 2 * fileCount * (size + 100) / blockSize);
+    FAT12 fs(imagePath, blockSize, blockCount);
+    fs.createDirectory("/d");
+    auto data = randomData(size);
+
+    measure(fs, "writeFile.create", {blockSize, size}, fileCount, size, [&](size_t i) {
+        fs.writeFile("/d/" + std::to_string(i), data);
+    });
+
+    data[data.size() / 2]++;
+    measure(fs, "writeFile.overwrite", {blockSize, size}, fileCount, size, [&](size_t i) {
+        fs.writeFile("/d/" + std::to_string(i), data);
+    });
+
+    measure(fs, "appendFile", {blockSize, size}, fileCount, 100, [&](size_t i) {
+        fs.appendFile("/d/" + std::to_string(i), std::vector<char>(100));
+    });
+
+    measure(fs, "readFile", {blockSize, size}, fileCount, size, [&](size_t i) {
+        fs.readFile("/d/" + std::to_string(i));
+    });
+}
+
+// Cold lookups each walk a chain of directories no earlier lookup visited, so only the root starts out cached.
+void benchLookup(int blockSize) {
+    size_t depth = 32;
+    size_t chainCount = 100;
+    auto chainPath = [&](size_t chain) {
+        Path path = "/chain" + std::to_string(chain);
+        for (size_t level = 0; level < depth; level++) {
+            path /= "level" + std::to_string(level);
+        }
+        return path;
+    };
+
+    {
+        FAT12 fs(imagePath, blockSize, 4 * chainCount * depth);
+        for (size_t chain = 0; chain < chainCount; chain++) {
+            Path path = "/chain" + std::to_string(chain);
+            fs.createDirectory(path);
+            for (size_t level = 0; level < depth; level++) {
+                path /= "level" + std::to_string(level);
+                fs.createDirectory(path);
+            }
+        }
+    }
+
+    // A fresh instance starts with empty caches.
+    FAT12 fs(imagePath);
+    measure(fs, "lookup.deep.cold", {blockSize}, chainCount, 0, [&](size_t i) {
+        fs.readAttributes(chainPath(i));
+    });
+
+    measure(fs, "lookup.deep.warm", {blockSize}, 10000, 0, [&](size_t) {
+        fs.readAttributes(chainPath(0));
+    });
+}
+
+void benchDeleteDirectory(int blockSize) {
+    FAT12 fs(imagePath, blockSize);
+    auto data = randomData(1024);
+    size_t width = 100;
+    size_t ops = 5;
+
+    for (size_t i = 0; i < ops; i++) {
+        Path path = "/wide" + std::to_string(i);
+        fs.createDirectory(path);
+        for (size_t j = 0; j < width; j++) {
+            fs.writeFile(path / std::to_string(j), data);
+        }
+    }
+
+    measure(fs, "deleteDirectory.wide", {blockSize, width}, ops, 0, [&](size_t i) {
+        fs.deleteDirectory("/wide" + std::to_string(i));
+    });
+}
+
+void benchDump(int blockSize) {
+    FAT12 fs(imagePath, blockSize);
+    auto data = randomData(8 * 1024);
+
+    // Fill the image.
+    try {
+        for (int i = 0;; i++) {
+            Path directory = "/" + std::to_string(i / 100);
+            if (i % 100 == 0) {
+                fs.createDirectory(directory);
+            }
+            fs.writeFile(directory / std::to_string(i), data);
+        }
+    } catch (const NoSpaceException&) {
+    }
+
+    measure(fs, "dump.full", {blockSize}, 20, 0, [&](size_t) {
+        fs.dump();
+    });
+}
+
+// Each thread writes, reads back, lists and deletes files in its own directory and reads files of a shared one.
+// Ops i of thread t are i + t * ops, so the directory of op i is i / ops.
+void benchParallel(int blockSize) {
+    auto data = randomData(8 * 1024);
+    size_t ops = 100;
+    size_t sharedCount = 16;
+
+    for (size_t threadCount : {1, 2, 4, 8}) {
+        FAT12 fs(imagePath, blockSize, 16 * 1024);
+        fs.createDirectory("/shared");
+        for (size_t i = 0; i < sharedCount; i++) {
+            fs.writeFile("/shared/" + std::to_string(i), data);
+        }
+        for (size_t thread = 0; thread < threadCount; thread++) {
+            fs.createDirectory("/" + std::to_string(thread));
+        }
+
+        measure(fs, "stress.parallel", {blockSize, data.size(), threadCount}, ops, data.size(), [&](size_t i) {
+            Path directory = "/" + std::to_string(i / ops);
+            fs.writeFile(directory / std::to_string(i), data);
+            if (fs.readFile(directory / std::to_string(i)) != data || fs.readFile("/shared/" + std::to_string(i % sharedCount)) != data) {
+                throw std::runtime_error("Parallel read returned wrong data.");
+            }
+            fs.listDirectory(directory);
+            if (i % ops >= 2) {
+                fs.deleteFile(directory / std::to_string(i - 2));
+            }
+        }, threadCount);
+    }
+}
+
+// Four threads share one image: one reads the shared files with readFiles, one creates, renames and deletes
+// entries, one rewrites the shared files with the same data and one defragments. The image must check clean after.
+void benchMixed(int blockSize) {
+    auto data = randomData(8 * 1024);
+    size_t ops = 50;
+    size_t sharedCount = 16;
+    size_t threadCount = 4;
+
+    FAT12 fs(imagePath, blockSize, 16 * 1024);
+    ThreadPool pool(4);
+    std::vector<Path> shared;
+    fs.createDirectory("/shared");
+    fs.createDirectory("/scratch");
+    for (size_t i = 0; i < sharedCount; i++) {
+        shared.push_back("/shared/" + std::to_string(i));
+        fs.writeFile(shared.back(), data);
+    }
+
+    measure(fs, "stress.mixed", {blockSize, data.size(), threadCount}, ops, 0, [&](size_t i) {
+        switch (i / ops) {
+        case 0:
+            for (auto& file : fs.readFiles(shared, pool)) {
+                if (file != data) {
+                    throw std::runtime_error("Concurrent readFiles returned wrong data.");
+                }
+            }
+            break;
+        case 1: {
+            Path directory = "/scratch/" + std::to_string(i);
+            fs.createDirectory(directory);
+            fs.writeFile(directory / "file", std::vector<char>(data.begin(), data.begin() + i % ops * 100));
+            auto attributes = fs.readAttributes(directory / "file");
+            attributes.name = "renamed";
+            fs.writeAttributes(directory / "file", attributes);
+            if (i % 2 == 0) {
+                fs.deleteDirectory(directory);
+            }
+            break;
+        }
+        case 2:
+            fs.writeFile(shared[i % sharedCount], data);
+            fs.appendFile("/scratch/log", std::vector<char>(data.begin(), data.begin() + 300));
+            break;
+        default:
+            fs.defragment("/", 64);
+            break;
+        }
+    }, threadCount);
+
+    auto report = fs.check();
+    if (!report.problems.empty()) {
+        throw std::runtime_error("stress.mixed: " + report.problems.front());
+    }
+}
+
+int main() {
+    int status = 0;
+    try {
+        for (int blockSize : blockSizes) {
+            benchCreateDirectory(blockSize);
+            for (size_t size : {1024, 8 * 1024, 30 * 1024, 1024 * 1024, 4 * 1024 * 1024}) {
+                benchFiles(blockSize, size);
+            }
+            benchLookup(blockSize);
+            benchDeleteDirectory(blockSize);
+            benchDump(blockSize);
+            benchParallel(blockSize);
+            benchMixed(blockSize);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        status = 1;
+    }
+
+    std::filesystem::remove(imagePath);
+    return status;
+}
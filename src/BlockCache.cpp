@@ -0,0 +1,105 @@
+#include "BlockCache.h"
+#include <algorithm>
+#include <cassert>
+
+BlockCache::BlockCache(size_t capacity) :
+    maxBlocks(capacity)
+{
+    assert(capacity > 0);
+}
+
+const std::vector<char>* BlockCache::find(size_t address) const {
+    auto it = index.find(address);
+    if (it == index.end()) {
+        misses.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    hits.fetch_add(1, std::memory_order_relaxed);
+    it->second->referenced.store(true, std::memory_order_relaxed);
+    return &it->second->block.data;
+}
+
+const std::vector<char>* BlockCache::peek(size_t address) const {
+    auto it = index.find(address);
+    return it != index.end() ? &it->second->block.data : nullptr;
+}
+
+std::vector<BlockCache::Block> BlockCache::insert(size_t address, const std::vector<char>& data, bool dirty) {
+    auto it = index.find(address);
+    if (it != index.end()) {
+        // Replace cached block. A dirty block stays dirty until it is written back.
+        auto& block = it->second->block;
+        block.data = data;
+        block.dirty = block.dirty || dirty;
+        it->second->referenced = true;
+        lru.splice(lru.begin(), lru, it->second);
+        return {};
+    }
+
+    // A new block starts out referenced, so it outlasts the eviction that makes room for it.
+    lru.emplace_front(Block{.address = address, .data = data, .dirty = dirty});
+    index[address] = lru.begin();
+    return evict();
+}
+
+std::vector<BlockCache::Block> BlockCache::takeDirty() {
+    std::vector<Block> dirty;
+
+    for (auto& entry : lru) {
+        if (entry.block.dirty) {
+            dirty.push_back(entry.block);
+            entry.block.dirty = false;
+        }
+    }
+
+    std::sort(dirty.begin(), dirty.end(), [](const Block& a, const Block& b) { return a.address < b.address; });
+    writebacks += dirty.size();
+    return dirty;
+}
+
+void BlockCache::discard(size_t address) {
+    auto it = index.find(address);
+    if (it != index.end()) {
+        lru.erase(it->second);
+        index.erase(it);
+    }
+}
+
+std::vector<BlockCache::Block> BlockCache::setCapacity(size_t capacity) {
+    assert(capacity > 0);
+    maxBlocks = capacity;
+    return evict();
+}
+
+BlockCache::Stats BlockCache::stats() const {
+    return {
+        .hits = hits.load(std::memory_order_relaxed),
+        .misses = misses.load(std::memory_order_relaxed),
+        .evictions = evictions,
+        .writebacks = writebacks
+    };
+}
+
+std::vector<BlockCache::Block> BlockCache::evict() {
+    std::vector<Block> dirty;
+
+    while (lru.size() > maxBlocks) {
+        // Blocks found since they last reached the back go to the front instead, once.
+        if (lru.back().referenced.exchange(false, std::memory_order_relaxed)) {
+            lru.splice(lru.begin(), lru, std::prev(lru.end()));
+            continue;
+        }
+
+        auto& victim = lru.back().block;
+        evictions++;
+        if (victim.dirty) {
+            writebacks++;
+            dirty.push_back(std::move(victim));
+        }
+        index.erase(lru.back().block.address);
+        lru.pop_back();
+    }
+
+    return dirty;
+}
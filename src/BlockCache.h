@@ -0,0 +1,70 @@
+#include <vector>
+#include <atomic>
+#include <list>
+#include <unordered_map>
+#include <cstddef>
+
+// Bounded cache of file system blocks with dirty tracking, evicting the least recently used with a second chance.
+// The cache never touches the disk itself; dirty blocks that fall out of it are handed back to the caller.
+// find may run concurrently with itself and peek, everything else needs exclusive access.
+class BlockCache {
+public:
+    struct Block {
+        size_t address;
+        std::vector<char> data;
+        bool dirty = false;
+    };
+
+    struct Stats {
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t evictions = 0;
+        size_t writebacks = 0;
+    };
+
+    BlockCache(size_t capacity);
+
+    // Returns the cached block or nullptr. Counts as a hit or a miss. A hit marks the block referenced instead of
+    // moving it to the front, so lookups do not modify the cache.
+    const std::vector<char>* find(size_t address) const;
+
+    // Returns the cached block or nullptr, without counting it or making it the most recently used.
+    const std::vector<char>* peek(size_t address) const;
+
+    bool contains(size_t address) const { return index.contains(address); }
+
+    // Inserts or replaces a block and returns the dirty blocks evicted to make room for it.
+    std::vector<Block> insert(size_t address, const std::vector<char>& data, bool dirty);
+
+    // Returns all dirty blocks sorted by address and marks them clean.
+    std::vector<Block> takeDirty();
+
+    // Drops a block without writing it back, e.g. after it was freed.
+    void discard(size_t address);
+
+    std::vector<Block> setCapacity(size_t capacity);
+    size_t capacity() const { return maxBlocks; }
+    size_t size() const { return index.size(); }
+    Stats stats() const;
+
+private:
+    struct Entry {
+        Entry(Block block) : block(std::move(block)) {}
+
+        Block block;
+        // Set when the block is found, so eviction passes over it once.
+        mutable std::atomic<bool> referenced = true;
+    };
+
+    size_t maxBlocks;
+    mutable std::atomic<size_t> hits = 0;
+    mutable std::atomic<size_t> misses = 0;
+    size_t evictions = 0;
+    size_t writebacks = 0;
+
+    // Most recently inserted block is at the front.
+    std::list<Entry> lru;
+    std::unordered_map<size_t, std::list<Entry>::iterator> index;
+
+    std::vector<Block> evict();
+};
@@ -0,0 +1,82 @@
+#include "DirectoryLocks.h"
+#include <cassert>
+
+namespace {
+    struct HeldLock {
+        bool exclusive = false;
+        size_t count = 0;
+    };
+
+    // The directory locks the current thread holds, by lock table and path.
+    thread_local std::map<std::pair<const void*, std::string>, HeldLock> heldLocks;
+}
+
+DirectoryLocks::Guard::~Guard() {
+    for (auto it = acquired.rbegin(); it != acquired.rend(); it++) {
+        locks.release(*it);
+    }
+}
+
+void DirectoryLocks::Guard::lock(const Path& directory, bool exclusive) {
+    std::vector<std::string> chain = {""};
+    Path prefix;
+    for (auto& name : directory) {
+        // A trailing separator yields an empty name, which must not make a second lock for the same directory.
+        if (!name.empty()) {
+            prefix /= name;
+            chain.push_back(prefix.string());
+        }
+    }
+
+    for (size_t i = 0; i < chain.size(); i++) {
+        locks.acquire(chain[i], exclusive && i + 1 == chain.size());
+        acquired.push_back(chain[i]);
+    }
+}
+
+void DirectoryLocks::acquire(const std::string& directory, bool exclusive) {
+    auto& held = heldLocks[{this, directory}];
+    if (held.count++ > 0) {
+        // Upgrading a shared lock would deadlock against another thread doing the same.
+        assert(held.exclusive || !exclusive);
+        return;
+    }
+    held.exclusive = exclusive;
+
+    Lock* lock;
+    {
+        std::lock_guard tableLock(tableMutex);
+        lock = &table[directory];
+        lock->users++;
+    }
+
+    if (exclusive) {
+        lock->mutex.lock();
+    } else {
+        lock->mutex.lock_shared();
+    }
+}
+
+void DirectoryLocks::release(const std::string& directory) {
+    auto held = heldLocks.find({this, directory});
+    assert(held != heldLocks.end());
+    if (--held->second.count > 0) {
+        return;
+    }
+    bool exclusive = held->second.exclusive;
+    heldLocks.erase(held);
+
+    std::lock_guard tableLock(tableMutex);
+    auto it = table.find(directory);
+    assert(it != table.end());
+
+    if (exclusive) {
+        it->second.mutex.unlock();
+    } else {
+        it->second.mutex.unlock_shared();
+    }
+
+    if (--it->second.users == 0) {
+        table.erase(it);
+    }
+}
@@ -0,0 +1,45 @@
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+// Reader/writer locks on directories by path. Locking a directory first locks each of its ancestors shared, top
+// down, so writers of independent subtrees do not contend and a writer of a directory excludes everything below it.
+// Locks a thread already holds are not taken again, so nested calls can lock a subset of what their caller holds.
+class DirectoryLocks {
+public:
+    using Path = std::filesystem::path;
+
+    // Releases the locks it took, in reverse order, when destroyed.
+    class Guard {
+    public:
+        Guard(DirectoryLocks& locks) : locks(locks) {}
+        ~Guard();
+
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+
+        // The empty path is the directory that contains the root directory entry, which is an ancestor of every path.
+        // Several directories must be locked in ascending path order, which puts ancestors first.
+        void lock(const Path& directory, bool exclusive);
+
+    private:
+        DirectoryLocks& locks;
+        std::vector<std::string> acquired;
+    };
+
+private:
+    struct Lock {
+        std::shared_mutex mutex;
+        size_t users = 0;
+    };
+
+    // Locks are created on first use and dropped when no thread holds or waits for them.
+    std::mutex tableMutex;
+    std::map<std::string, Lock> table;
+
+    void acquire(const std::string& directory, bool exclusive);
+    void release(const std::string& directory);
+};
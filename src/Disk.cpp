@@ -1,25 +1,235 @@
 #include "Disk.h"
 #include <iostream>
 #include <cassert>
+#include <cstring>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <climits>
 
-Disk::Disk(const std::string& path, bool trunc) :
-    fs(path, trunc ? std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc
-                   : std::ios::binary | std::ios::in | std::ios::out
-    )
+namespace {
+    // Transfers iovecs at offset, resuming after short transfers. Reads past the end of the image yield zeros.
+    template<typename Transfer>
+    void transferAll(std::vector<iovec> iovecs, off_t offset, bool isRead, Transfer transfer) {
+        size_t index = 0;
+
+        while (index < iovecs.size()) {
+            int count = std::min<size_t>(iovecs.size() - index, IOV_MAX);
+            ssize_t result = transfer(iovecs.data() + index, count, offset);
+
+            if (result < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::system_error(errno, std::generic_category(), isRead ? "Disk read failed" : "Disk write failed");
+            }
+
+            if (result == 0) {
+                assert(isRead);
+                for (; index < iovecs.size(); index++) {
+                    std::memset(iovecs[index].iov_base, 0, iovecs[index].iov_len);
+                }
+                return;
+            }
+
+            offset += result;
+
+            // Skip the fully transferred buffers and trim the partially transferred one.
+            while (result > 0) {
+                if ((size_t)result >= iovecs[index].iov_len) {
+                    result -= iovecs[index].iov_len;
+                    index++;
+                } else {
+                    iovecs[index].iov_base = (char*)iovecs[index].iov_base + result;
+                    iovecs[index].iov_len -= result;
+                    result = 0;
+                }
+            }
+        }
+    }
+}
+
+Disk::Disk(const std::string& path, bool trunc, Backend backend) :
+    fd(::open(path.c_str(), trunc ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644)),
+    diskBackend(backend)
 {
-    assert(fs);
+    assert(fd >= 0);
+
+    if (diskBackend == Backend::Mapped) {
+        struct stat st;
+        int result = ::fstat(fd, &st);
+        assert(result == 0);
+        map(st.st_size);
+    }
+}
+
+Disk::~Disk() {
+    if (mapping) {
+        ::munmap(mapping, mappingSize);
+    }
+    ::close(fd);
 }
 
 void Disk::write(size_t address, const std::array<char, sectorSize>& sector) {
-    fs.seekg(address * sectorSize);
-    fs.write(sector.data(), sectorSize);
+    write(address, std::span<const char>(sector));
 }
 
 std::array<char, Disk::sectorSize> Disk::read(size_t address) {
     std::array<char, sectorSize> buffer;
-    
-    fs.seekg(address * sectorSize);
-    fs.read(buffer.data(), sectorSize);
-
+    read(address, std::span<char>(buffer));
     return buffer;
 }
+
+void Disk::write(size_t address, std::span<const char> buffer) {
+    writev(address, {buffer});
+}
+
+void Disk::read(size_t address, std::span<char> buffer) {
+    readv(address, {buffer});
+}
+
+void Disk::writev(size_t address, const std::vector<std::span<const char>>& buffers) {
+    ScopedTimer timer("Disk::write", writeCalls, trace);
+    for (auto& buffer : buffers) {
+        sectorsWrittenCount += buffer.size() / sectorSize;
+    }
+
+    if (diskBackend == Backend::Mapped) {
+        // Growing would remap the image under concurrent transfers, so writes stay inside what was reserved.
+        size_t end = address * sectorSize;
+        for (auto& buffer : buffers) {
+            assert(buffer.size() % sectorSize == 0);
+            end += buffer.size();
+        }
+        if (end > mappingSize) {
+            throw std::system_error(ENOSPC, std::generic_category(), "Disk write past the end of the mapped image");
+        }
+
+        size_t offset = address * sectorSize;
+        for (auto& buffer : buffers) {
+            std::memcpy(mapping + offset, buffer.data(), buffer.size());
+            offset += buffer.size();
+        }
+        return;
+    }
+
+    std::vector<iovec> iovecs;
+    for (auto& buffer : buffers) {
+        assert(buffer.size() % sectorSize == 0);
+        iovecs.push_back({(void*)buffer.data(), buffer.size()});
+    }
+
+    transferAll(std::move(iovecs), address * sectorSize, false, [this](const iovec* iov, int count, off_t offset) {
+        return ::pwritev(fd, iov, count, offset);
+    });
+}
+
+void Disk::readv(size_t address, const std::vector<std::span<char>>& buffers) {
+    ScopedTimer timer("Disk::read", readCalls, trace);
+    for (auto& buffer : buffers) {
+        sectorsReadCount += buffer.size() / sectorSize;
+    }
+
+    if (diskBackend == Backend::Mapped) {
+        size_t offset = address * sectorSize;
+        for (auto& buffer : buffers) {
+            assert(buffer.size() % sectorSize == 0);
+
+            // Reads past the end of the image yield zeros.
+            size_t available = offset < mappingSize ? std::min(buffer.size(), mappingSize - offset) : 0;
+            std::memcpy(buffer.data(), mapping + offset, available);
+            std::memset(buffer.data() + available, 0, buffer.size() - available);
+            offset += buffer.size();
+        }
+        return;
+    }
+
+    std::vector<iovec> iovecs;
+    for (auto& buffer : buffers) {
+        assert(buffer.size() % sectorSize == 0);
+        iovecs.push_back({buffer.data(), buffer.size()});
+    }
+
+    transferAll(std::move(iovecs), address * sectorSize, true, [this](const iovec* iov, int count, off_t offset) {
+        return ::preadv(fd, iov, count, offset);
+    });
+}
+
+void Disk::advise(size_t address, size_t sectorCount) {
+    ScopedTimer timer("Disk::advise", adviseCalls, trace);
+    size_t offset = address * sectorSize;
+    size_t length = sectorCount * sectorSize;
+
+    // Hints are best effort, so their errors are ignored.
+    if (diskBackend == Backend::Mapped) {
+        if (offset >= mappingSize) {
+            return;
+        }
+
+        // madvise takes a page aligned address.
+        size_t pageSize = ::sysconf(_SC_PAGESIZE);
+        size_t begin = offset / pageSize * pageSize;
+        size_t end = std::min(offset + length, mappingSize);
+        ::madvise(mapping + begin, end - begin, MADV_WILLNEED);
+        return;
+    }
+
+    ::posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED);
+}
+
+void Disk::reserve(size_t sectorCount) {
+    // pwrite grows the file backend as needed.
+    size_t size = sectorCount * sectorSize;
+    if (diskBackend != Backend::Mapped || size <= mappingSize) {
+        return;
+    }
+
+    struct stat st;
+    int result = ::fstat(fd, &st);
+    assert(result == 0);
+    if ((size_t)st.st_size < size && ::ftruncate(fd, size) != 0) {
+        throw std::system_error(errno, std::generic_category(), "Disk resize failed");
+    }
+
+    map(size);
+}
+
+void Disk::sync() {
+    int result = mapping ? ::msync(mapping, mappingSize, MS_SYNC) : ::fdatasync(fd);
+    if (result != 0) {
+        throw std::system_error(errno, std::generic_category(), "Disk sync failed");
+    }
+}
+
+Disk::Stats Disk::stats() const {
+    return {
+        .reads = readCalls.value(),
+        .writes = writeCalls.value(),
+        .advises = adviseCalls.value(),
+        .sectorsRead = sectorsReadCount,
+        .sectorsWritten = sectorsWrittenCount
+    };
+}
+
+void Disk::map(size_t size) {
+    if (mapping) {
+        ::munmap(mapping, mappingSize);
+        mapping = nullptr;
+        mappingSize = 0;
+    }
+
+    if (size == 0) {
+        return;
+    }
+
+    void* address = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (address == MAP_FAILED) {
+        throw std::system_error(errno, std::generic_category(), "Disk map failed");
+    }
+
+    mapping = (char*)address;
+    mappingSize = size;
+}
@@ -1,14 +1,74 @@
+#include "Trace.h"
 #include <array>
-#include <fstream>
+#include <span>
+#include <string>
+#include <vector>
+#include <atomic>
 
+// Sector-addressed disk image. All I/O is positional, so a Disk can be used from several threads at once.
 class Disk {
 public:
-    Disk(const std::string& path, bool trunc);
+    enum class Backend {
+        File,   // pread/pwrite on a file descriptor.
+        Mapped  // Whole image mapped into memory, I/O is a copy to or from the mapping.
+    };
+
+    Disk(const std::string& path, bool trunc, Backend backend = Backend::File);
+    ~Disk();
+
+    Disk(const Disk&) = delete;
+    Disk& operator=(const Disk&) = delete;
 
     static constexpr int sectorSize = 512;
 
     void write(size_t address, const std::array<char, sectorSize>& sector);
     std::array<char, sectorSize> read(size_t address);
+
+    // Transfer a contiguous range of sectors starting at address. Buffer sizes must be multiples of sectorSize.
+    void write(size_t address, std::span<const char> buffer);
+    void read(size_t address, std::span<char> buffer);
+
+    // Scatter/gather a contiguous range of sectors starting at address across several buffers. Writes to a mapped
+    // image must end inside the part reserved with reserve.
+    void writev(size_t address, const std::vector<std::span<const char>>& buffers);
+    void readv(size_t address, const std::vector<std::span<char>>& buffers);
+
+    // Hints that sectorCount sectors starting at address will be read soon, so the kernel starts fetching them in
+    // the background. Uses posix_fadvise for the file backend and madvise for mapped images.
+    void advise(size_t address, size_t sectorCount);
+
+    // Grows a mapped image to at least sectorCount sectors. Not safe to call concurrently with other I/O.
+    void reserve(size_t sectorCount);
+
+    // Makes written sectors durable. Uses fdatasync for the file backend and msync for mapped images.
+    void sync();
+
+    Backend backend() const { return diskBackend; }
+
+    struct Stats {
+        CallStats reads;
+        CallStats writes;
+        CallStats advises;
+        size_t sectorsRead = 0;
+        size_t sectorsWritten = 0;
+    };
+
+    Stats stats() const;
+
+    // Records a span for every read and write in trace. Pass nullptr to stop.
+    void setTrace(Trace* trace) { this->trace = trace; }
 private:
-    std::fstream fs;
+    int fd;
+    Backend diskBackend;
+    char* mapping = nullptr;
+    size_t mappingSize = 0;
+
+    CallCounter readCalls;
+    CallCounter writeCalls;
+    CallCounter adviseCalls;
+    std::atomic<size_t> sectorsReadCount = 0;
+    std::atomic<size_t> sectorsWrittenCount = 0;
+    Trace* trace = nullptr;
+
+    void map(size_t size);
 };
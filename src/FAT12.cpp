@@ -1,18 +1,33 @@
 #include "FAT12.h"
 #include "exceptions.h"
+#include "ThreadPool.h"
 #include <cassert>
 #include <cmath>
 #include <iostream>
 #include <algorithm>
-
-FAT12::FAT12(const std::string& diskPath, uint16_t blockSize) :
-    disk(diskPath, true),
-    sb({.blockSize = blockSize})
+#include <numeric>
+#include <set>
+#include <unordered_set>
+#include <utility>
+
+thread_local int FAT12::threadOperationDepth = 0;
+
+FAT12::FAT12(const std::string& diskPath, uint16_t blockSize, size_t blockCount, Disk::Backend backend) :
+    diskPath(diskPath),
+    disk(diskPath, true, backend),
+    sb({
+        .blockSize = blockSize,
+        .blockCount = (uint32_t)blockCount,
+        .journalBlockCount = (uint32_t)std::clamp(blockCount / 32, minJournalBlockCount, maxJournalBlockCount)
+    }),
+    fat(blockCount, freeBlockMarker())
 {
     assert(blockSize == 512 || blockSize == 1024 || blockSize == 2048 || blockSize == 4096);
+    assert(blockCount >= minBlockCount && blockCount <= maxBlockCount);
+    disk.reserve(blockToSector(fat.size()));
+
+    dirtyFatBlocks.assign(dataAddress(), true);
 
-    fat.fill(freeBlockMarker());
-    
     // Occupy addresses for FAT in FAT.
     for (int i = 0; i < dataAddress(); i++) {
         fat[i] = lastBlockMarker();
@@ -20,6 +35,16 @@ FAT12::FAT12(const std::string& diskPath, uint16_t blockSize) :
 
     // Write the root directory entry to dataAddress().
     fat[dataAddress()] = lastBlockMarker();
+
+    // Reserve the journal right after it.
+    sb.journalAddress = dataAddress() + 1;
+    for (size_t i = 0; i < sb.journalBlockCount; i++) {
+        fat[sb.journalAddress + i] = lastBlockMarker();
+    }
+    journal.emplace(disk, blockToSector(sb.journalAddress), sb.blockSize, sb.journalBlockCount);
+    journal->reset();
+
+    buildFreeSpace();
     auto now = getNow();
     DirectoryEntry rootDirectoryEntry = {
         .attributes = {
@@ -30,58 +55,105 @@ FAT12::FAT12(const std::string& diskPath, uint16_t blockSize) :
         }
     };
     // Empty string represents the directory that contains root directory entry.
-    sb.rootDirectoryEntrySize = writeDirectory("", {rootDirectoryEntry});
-
-    writeSuperblock();
-    writeFat();
+    writeBlock(dataAddress(), std::vector<char>(sb.blockSize));
+    writeDirectory(dataAddress(), 0, rootDirectoryEntry);
+    sb.rootDirectoryEntrySize = directoryEntrySize;
+
+    // Start out with everything at its home location.
+    superblockDirty = true;
+    flush();
+    checkpoint();
 }
 
-FAT12::FAT12(const std::string& diskPath) :
-    disk(diskPath, false)
+FAT12::FAT12(const std::string& diskPath, Disk::Backend backend) :
+    diskPath(diskPath),
+    disk(diskPath, false, backend)
 {
     readSuperblock();
+    if (sb.formatVersion != formatVersion) {
+        throw UnsupportedFormatException(diskPath);
+    }
+
+    // Everything below sizes buffers and seeks by these, so they are checked before use.
+    bool validBlockSize = sb.blockSize == 512 || sb.blockSize == 1024 || sb.blockSize == 2048 || sb.blockSize == 4096;
+    if (!validBlockSize || sb.blockCount < minBlockCount || sb.blockCount > maxBlockCount ||
+        sb.rootDirectoryEntrySize != directoryEntrySize || sb.journalAddress < 0 || (uint32_t)sb.journalAddress >= sb.blockCount ||
+        sb.journalBlockCount < minJournalBlockCount || sb.journalBlockCount > sb.blockCount - (uint32_t)sb.journalAddress) {
+        throw CorruptImageException(diskPath);
+    }
+    disk.reserve(blockToSector(sb.blockCount));
+
+    // Committed blocks that were not checkpointed yet are served from memory until the next checkpoint.
+    journal.emplace(disk, blockToSector(sb.journalAddress), sb.blockSize, sb.journalBlockCount);
+    for (auto& record : journal->replay()) {
+        checkpointBlocks[record.address] = std::move(record.data);
+    }
+
     readFat();
 }
 
+FAT12::~FAT12() {
+    // Close drops the handle even when writing its entry fails.
+    while (!openFiles.empty()) {
+        try {
+            close(openFiles.begin()->first);
+        } catch (const std::exception&) {
+        }
+    }
+
+    try {
+        flush();
+    } catch (const std::exception&) {
+    }
+}
+
 void FAT12::writeAttributes(const Path& path, const FileAttributes& attributes) {
+    Operation operation(*this);
+    // A renamed directory changes the paths of everything below it.
+    DirectoryLocks::Guard guard(directoryLocks);
+    guard.lock(parentPath(path), true);
+    guard.lock(path, true);
+
     DirectoryEntry entry = readDirectoryEntry(path);
+    if (attributes.name != entry.attributes.name && isOpen(path, true)) {
+        throw FileInUseException(path);
+    }
     entry.attributes = attributes;
     writeDirectoryEntry(path, entry);
 }
 
 FAT12::FileAttributes FAT12::readAttributes(const Path& path) {
+    DirectoryLocks::Guard guard(directoryLocks);
+    guard.lock(parentPath(path), false);
+
     DirectoryEntry entry = readDirectoryEntry(path);
     return entry.attributes;
 }
 
 void FAT12::createDirectory(const Path& path) {
-    checkPermission(parentPath(path), "w");
+    Operation operation(*this);
+    DirectoryLocks::Guard guard(directoryLocks);
+    guard.lock(parentPath(path), true);
 
-    auto parent = readDirectory(parentPath(path));
-    std::string name = pathToName(path);
-
-    // Check if it already exists.
-    for (auto& entry : parent) {
-        if (entry.attributes.name == name) {
-            throw FileExistsException(path);
-        }
-    }
+    checkPermission(parentPath(path), "w");
 
     // Add new directory's directory entry to its parent directory.
     auto now = getNow();
     DirectoryEntry entry = {
         .attributes = {
             .isDirectory = true,
-            .name = name,
+            .name = pathToName(path),
             .created = now,
             .lastModified = now
         }
     };
-    parent.push_back(entry);
-    writeDirectory(parentPath(path), parent, true);
+    addDirectoryEntry(path, entry);
 }
 
 std::vector<FAT12::FileAttributes> FAT12::listDirectory(const Path& path) {
+    DirectoryLocks::Guard guard(directoryLocks);
+    guard.lock(path, false);
+
     checkPermission(path, "r");
 
     // If it is a file, return its attributes.
@@ -101,528 +173,2472 @@ std::vector<FAT12::FileAttributes> FAT12::listDirectory(const Path& path) {
 }
 
 void FAT12::deleteDirectory(const Path& path) {
-    checkPermission(path, "w");
+    Operation operation(*this);
+    DirectoryLocks::Guard guard(directoryLocks);
+    guard.lock(parentPath(path), true);
+    guard.lock(path, true);
 
-    auto self = readDirectory(path);
-    auto parent = readDirectory(parentPath(path));
-    std::string name = pathToName(path);
+    if (isOpen(path, true)) {
+        throw FileInUseException(path);
+    }
+
+    // The entries of the deleted directories are freed with their blocks, so only the top one is removed.
+    freeDirectory(path);
+    removeDirectoryEntry(path);
+}
+
+void FAT12::freeDirectory(const Path& path) {
+    checkPermission(path, "w");
 
-    // Delete directory recursively.
-    for (auto& entry : self) {
+    auto directory = readDirectoryEntry(path);
+    for (auto& entry : readDirectory(path)) {
         if (entry.attributes.isDirectory) {
-            deleteDirectory(path/entry.attributes.name);
+            freeDirectory(path/entry.attributes.name);
         } else {
             freeBlocks(entry.firstBlockAddress);
         }
     }
 
-    // Free the blocks occupied by directory.
-    freeBlocks(path);
-
-    for (size_t i = 0; i < parent.size(); i++) {
-        if (parent[i].attributes.name == name) {
-            // Remove directory's directory entry from its parent directory.
-            parent.erase(parent.begin() + i);
-            writeDirectory(parentPath(path), parent, true);
-            return;
-        }
-    }
+    // Free the blocks occupied by directory and its index.
+    freeBlocks(directory.firstBlockAddress);
+    freeBlocks(directory.indexBlockAddress);
 }
 
 void FAT12::writeFile(const Path& path, const std::vector<char>& data) {
-    auto parent = readDirectory(parentPath(path));
-    std::string name = pathToName(path);
+    Operation operation(*this);
+    DirectoryLocks::Guard guard(directoryLocks);
+    guard.lock(parentPath(path), true);
+
+    auto handle = open(path, true);
+    HandleGuard handleGuard(*this, handle);
+    auto& file = openFile(handle);
+    size_t keptBlockCount = std::min(blockCount(file.size), blockCount(data.size()));
+    size_t oldSize = file.size;
+
+    // Reuse the existing chain, only its tail is allocated or freed.
+    resize(file, data.size());
+
+    // Compare the kept blocks with the new data and rewrite only the changed ones.
+    forEachRun(file, 0, keptBlockCount * sb.blockSize, [&](size_t blockIndex, BlockAddress blockAddress, size_t blockCount) {
+        // Compare long runs in slices to bound memory use.
+        for (size_t slice = 0; slice < blockCount; slice += compareSliceBlockCount) {
+            size_t sliceLength = std::min(compareSliceBlockCount, blockCount - slice);
+            writeChangedBlocks(blockAddress + slice, blockIndex + slice, sliceLength, oldSize, data);
+        }
+    });
+
+    // Write the new tail blocks.
+    size_t tailOffset = keptBlockCount * sb.blockSize;
+    if (tailOffset < data.size()) {
+        forEachRun(file, tailOffset, data.size() - tailOffset, [&](size_t blockIndex, BlockAddress blockAddress, size_t blockCount) {
+            size_t begin = blockIndex * sb.blockSize;
+            size_t length = std::min(blockCount * sb.blockSize, data.size() - begin);
+            writeExtent(blockAddress, std::span<const char>(data.data() + begin, length));
+        });
+    }
 
-    try {
-        // Try writing to existing file.
-        checkIsDirectory(path, false);
-        checkPermission(path, "w");
+    handleGuard.release();
+    close(handle);
+}
 
-        auto [address, size] = pathToAddressAndSize(path);
-        writeBlocks(address, data);
+void FAT12::appendFile(const Path& path, const std::vector<char>& data) {
+    Operation operation(*this);
+    DirectoryLocks::Guard guard(directoryLocks);
+    guard.lock(parentPath(path), true);
+
+    auto handle = open(path, true);
+    HandleGuard handleGuard(*this, handle);
+    write(handle, size(handle), data);
+    openFile(handle).modified = true;
+    handleGuard.release();
+    close(handle);
+}
 
-        // Update attributes.
-        auto attributes = readAttributes(path);
-        attributes.size = data.size();
-        attributes.lastModified = getNow();
-        writeAttributes(path, attributes);
-    } catch (const NoSuchFileOrDirectoryException& e) {
-        // Create new file.
-        checkPermission(parentPath(path), "w");
+std::vector<char> FAT12::readFile(const Path& path) {
+    // The parent stays locked, so the size cannot change before the read.
+    DirectoryLocks::Guard guard(directoryLocks);
+    guard.lock(parentPath(path), false);
 
-        auto address = writeBlocks(lastBlockMarker(), data);
+    std::vector<char> data(readAttributes(path).size);
+    readFile(path, data);
 
-        // Add new file's directory entry to its parent directory.
-        auto now = getNow();
-        DirectoryEntry entry = {
-            .attributes = {
-                .isDirectory = false,
-                .name = name,
-                .size = (BlockAddress)data.size(),
-                .created = now,
-                .lastModified = now
-            },
-            .firstBlockAddress = address
-        };
-        parent.push_back(entry);
-        writeDirectory(parentPath(path), parent, true);
-    }
+    return data;
 }
 
-std::vector<char> FAT12::readFile(const Path& path) {
+size_t FAT12::readFile(const Path& path, std::span<char> buffer) {
+    DirectoryLocks::Guard guard(directoryLocks);
+    guard.lock(parentPath(path), false);
+
     checkIsDirectory(path, false);
     checkPermission(path, "r");
 
     auto [address, size] = pathToAddressAndSize(path);
+    size_t length = std::min<size_t>(size, buffer.size());
+    readBlocks(chainAddresses(address, blockCount(length)), buffer.first(length), false);
 
-    auto data = readBlocks(address);
-    data.resize(size);
+    return length;
+}
 
-    return data;
+std::vector<std::vector<char>> FAT12::readFiles(const std::vector<Path>& paths, size_t threadCount) {
+    ThreadPool pool(threadCount);
+    return readFiles(paths, pool);
 }
 
-void FAT12::deleteFile(const Path& path) {
-    checkIsDirectory(path, false);
-    checkPermission(path, "w");
+std::vector<std::vector<char>> FAT12::readFiles(const std::vector<Path>& paths, ThreadPool& pool) {
+    std::vector<std::vector<char>> files(paths.size());
+    std::vector<FileSize> sizes(paths.size());
+    std::vector<std::vector<FreeSpace::Extent>> extents(paths.size());
 
-    auto parent = readDirectory(parentPath(path));
-    std::string name = pathToName(path);
+    // Hold the parents until the reads are done. Sets order paths element by element, so ancestors come first.
+    DirectoryLocks::Guard guard(directoryLocks);
+    std::set<Path> parents;
+    for (auto& path : paths) {
+        parents.insert(parentPath(path));
+    }
+    for (auto& parent : parents) {
+        guard.lock(parent, false);
+    }
 
-    // Free the blocks occupied by file.
-    freeBlocks(path);
+    // Resolve every chain before any worker starts, the workers only touch the disk.
+    for (size_t i = 0; i < paths.size(); i++) {
+        checkIsDirectory(paths[i], false);
+        checkPermission(paths[i], "r");
 
-    for (size_t i = 0; i < parent.size(); i++) {
-        if (parent[i].attributes.name == name) {
-            // Remove file's directory entry from its parent directory.
-            parent.erase(parent.begin() + i);
-            writeDirectory(parentPath(path), parent, true);
-            return;
-        }
+        // A chain longer than the file, as in an unchecked image, is only read as far as the buffer goes.
+        auto [address, size] = pathToAddressAndSize(paths[i]);
+        sizes[i] = size;
+        files[i].resize(blockCount(size) * sb.blockSize);
+        extents[i] = chainExtents(address, blockCount(size));
     }
-}
 
-std::string FAT12::dump() {
-    std::ostringstream oss;
-    
-    int freeBlockCount = 0;
-    for (BlockAddress address : fat) {
-        if (address == freeBlockMarker()) {
-            freeBlockCount++;
+    std::vector<std::future<void>> reads;
+    size_t blocksPerRead = std::max<size_t>(parallelReadSize / sb.blockSize, 1);
+
+    // Split long runs so that large files are read in parallel too.
+    for (size_t i = 0; i < paths.size(); i++) {
+        char* destination = files[i].data();
+
+        for (auto& extent : extents[i]) {
+            for (size_t offset = 0; offset < extent.length; offset += blocksPerRead) {
+                size_t length = std::min(blocksPerRead, extent.length - offset) * sb.blockSize;
+                size_t sector = blockToSector(extent.address + offset);
+                reads.push_back(pool.submit([this, sector, destination, length]() {
+                    disk.read(sector, std::span<char>(destination, length));
+                }));
+                destination += length;
+            }
         }
     }
 
-    int fileCount = 0;
-    int directoryCount = 0;
-    std::string directoryDump = dumpDirectory("", 0, fileCount, directoryCount);
+    for (auto& read : reads) {
+        read.get();
+    }
 
-    oss << "Block count: " << fat.size() << std::endl;
-    oss << "Free blocks: " << freeBlockCount << std::endl;
-    oss << "Block size: " << sb.blockSize << std::endl;
-    oss << "File count: " << fileCount << std::endl;
-    oss << "Directory count: " << directoryCount << std::endl;
-    oss << directoryDump;
+    for (size_t i = 0; i < paths.size(); i++) {
+        files[i].resize(sizes[i]);
+    }
 
-    return oss.str();
+    return files;
 }
 
-std::string FAT12::dumpDirectory(const Path& path, int indent, int& fileCount, int& directoryCount) {
-    std::ostringstream oss;
-    auto directory = readDirectory(path);
+void FAT12::deleteFile(const Path& path) {
+    Operation operation(*this);
+    DirectoryLocks::Guard guard(directoryLocks);
+    guard.lock(parentPath(path), true);
 
-    for (auto& entry : directory) {
-        oss << std::string(indent, ' ');
-        oss << entry.attributes.name << " ";
-        
-        // Write contiguous addresses with a dash between begin and end addresses.
-        // Write "->" to denote jumping to a noncontiguous address.
-        BlockAddress beginAddress = entry.firstBlockAddress;
-        if (beginAddress != -1) {
-            oss << beginAddress;
-        }
-        for (BlockAddress address = entry.firstBlockAddress; address != lastBlockMarker(); address = fat[address]) {
-            if (fat[address] != address + 1) {
-                if (address != beginAddress) {
-                    oss << "-" << address;
-                }
-                if (fat[address] != lastBlockMarker()) {
-                    oss << "->" << fat[address];
-                    beginAddress = fat[address];
-                }
-            }
-        }
+    checkIsDirectory(path, false);
+    checkPermission(path, "w");
+    if (isOpen(path)) {
+        throw FileInUseException(path);
+    }
+
+    // Free the blocks occupied by file.
+    freeBlocks(path);
+    removeDirectoryEntry(path);
+}
 
-        oss << std::endl;
+FAT12::FileHandle FAT12::open(const Path& path, bool write, bool truncate) {
+    Operation operation(*this);
+    DirectoryLocks::Guard guard(directoryLocks);
+    guard.lock(parentPath(path), write);
+    assert(write || !truncate);
 
-        if (entry.attributes.isDirectory) {
-            directoryCount++;
-            oss << dumpDirectory(path/entry.attributes.name, indent + 2, fileCount, directoryCount);
-        } else {
-            fileCount++;
+    DirectoryEntry entry;
+    bool created = false;
+    try {
+        checkIsDirectory(path, false);
+        checkPermission(path, write ? "w" : "r");
+        entry = readDirectoryEntry(path);
+    } catch (const NoSuchFileOrDirectoryException& e) {
+        if (!write) {
+            throw;
         }
+
+        createFile(path);
+        entry = readDirectoryEntry(path);
+        created = true;
     }
 
-    return oss.str();
-}
+    // A write handle may truncate or reallocate the chain, which other handles would still walk.
+    if (write && isOpen(path)) {
+        throw FileInUseException(path);
+    }
 
-void FAT12::checkIsDirectory(const Path& path, bool shouldBeDirectory) {
-    bool isDirectory = path.empty() || readAttributes(path).isDirectory;
-    if (shouldBeDirectory && !isDirectory) {
-        throw NotADirectoryException(path);
+    OpenFile file = {
+        .path = path,
+        .firstBlockAddress = entry.firstBlockAddress,
+        .size = (size_t)entry.attributes.size,
+        .canWrite = write,
+        .created = created,
+        .cursorAddress = entry.firstBlockAddress
+    };
+
+    if (truncate) {
+        resize(file, 0);
     }
-    if (!shouldBeDirectory && isDirectory) {
-        throw IsADirectoryException(path);
+
+    std::lock_guard lock(openFilesMutex);
+    openFiles[nextFileHandle] = file;
+    return nextFileHandle++;
+}
+
+size_t FAT12::read(FileHandle handle, size_t offset, std::span<char> buffer) {
+    auto& file = openFile(handle);
+    DirectoryLocks::Guard guard(directoryLocks);
+    guard.lock(parentPath(file.path), false);
+
+    if (offset >= file.size) {
+        return 0;
     }
+    size_t length = std::min(buffer.size(), file.size - offset);
+    prefetch(file, offset / sb.blockSize);
+
+    forEachRun(file, offset, length, [&](size_t blockIndex, BlockAddress blockAddress, size_t blockCount) {
+        size_t runBegin = blockIndex * sb.blockSize;
+        size_t runEnd = runBegin + blockCount * sb.blockSize;
+        size_t begin = std::max(runBegin, offset);
+        size_t end = std::min(runEnd, offset + length);
+
+        if (begin == runBegin && end == runEnd) {
+            // Whole blocks are read straight into the caller's buffer.
+            disk.read(blockToSector(blockAddress), buffer.subspan(begin - offset, end - begin));
+        } else {
+            std::vector<char> run(runEnd - runBegin);
+            disk.read(blockToSector(blockAddress), run);
+            std::copy(run.begin() + (begin - runBegin), run.begin() + (end - runBegin), buffer.begin() + (begin - offset));
+        }
+    });
+
+    return length;
 }
 
-void FAT12::checkPermission(const Path& path, const std::string& permission) {
-    assert(permission == "r" || permission == "w");
+void FAT12::write(FileHandle handle, size_t offset, std::span<const char> data) {
+    // The new blocks are committed with the entry when the handle is closed.
+    Operation operation(*this, false);
+    auto& file = openFile(handle);
+    DirectoryLocks::Guard guard(directoryLocks);
+    guard.lock(parentPath(file.path), true);
+    assert(file.canWrite);
 
-    // The directory that contains root directory entry has no attributes.
-    if (path.empty()) {
+    if (data.empty()) {
         return;
     }
 
-    auto attributes = readAttributes(path);
-    if (permission == "r" && !attributes.canRead || permission == "w" && !attributes.canWrite) {
-        throw PermissionException(path);
+    // Writing past the end leaves a hole that reads as zeros. It is filled in pieces, so its size does not
+    // decide how much memory the write takes.
+    if (offset > file.size) {
+        std::vector<char> zeros(std::min(zeroFillSize, offset - file.size));
+        while (file.size < offset) {
+            write(handle, file.size, std::span<const char>(zeros).first(std::min(zeros.size(), offset - file.size)));
+        }
+    }
+
+    // Grow the chain at its tail.
+    size_t oldSize = file.size;
+    if (offset + data.size() > file.size) {
+        resize(file, offset + data.size());
     }
+    file.modified = true;
+
+    forEachRun(file, offset, data.size(), [&](size_t blockIndex, BlockAddress blockAddress, size_t blockCount) {
+        size_t runBegin = blockIndex * sb.blockSize;
+        size_t runEnd = runBegin + blockCount * sb.blockSize;
+        size_t begin = std::max(runBegin, offset);
+        size_t end = std::min(runEnd, offset + data.size());
+        auto source = data.subspan(begin - offset, end - begin);
+
+        if (begin == runBegin && (end == runEnd || end == file.size)) {
+            // Whole blocks, or the new last block, are written straight from the caller's data.
+            writeExtent(blockAddress, source);
+            return;
+        }
+
+        // Keep the existing bytes of partially overwritten first and last blocks.
+        std::vector<char> run(runEnd - runBegin);
+        if (begin != runBegin && runBegin < oldSize) {
+            disk.read(blockToSector(blockAddress), std::span<char>(run).first(sb.blockSize));
+        }
+        size_t lastBlockBegin = runEnd - sb.blockSize;
+        if (end != runEnd && lastBlockBegin < oldSize && (lastBlockBegin != runBegin || begin == runBegin)) {
+            disk.read(blockToSector(blockAddress + blockCount - 1), std::span<char>(run).last(sb.blockSize));
+        }
+
+        std::copy(source.begin(), source.end(), run.begin() + (begin - runBegin));
+        writeExtent(blockAddress, run);
+    });
 }
 
-FAT12::Path FAT12::pathToName(const Path& path) {
-    assert(!path.empty());
+void FAT12::truncate(FileHandle handle, size_t size) {
+    // The freed blocks are committed with the entry when the handle is closed.
+    Operation operation(*this, false);
+    auto& file = openFile(handle);
+    DirectoryLocks::Guard guard(directoryLocks);
+    guard.lock(parentPath(file.path), true);
+    assert(file.canWrite);
 
-    if (path == path.root_path()) {
-        return "/";
+    if (size < file.size) {
+        resize(file, size);
     }
+}
 
-    if (path.has_filename()) {
-        return path.filename();
+void FAT12::close(FileHandle handle) {
+    Operation operation(*this);
+
+    // The handle is dropped only under the directory lock, so defragment does not move the file before its entry
+    // is written.
+    auto& openedFile = openFile(handle);
+    DirectoryLocks::Guard guard(directoryLocks);
+    guard.lock(parentPath(openedFile.path), openedFile.modified);
+
+    OpenFile file;
+    {
+        std::lock_guard lock(openFilesMutex);
+        auto it = openFiles.find(handle);
+        file = std::move(it->second);
+        openFiles.erase(it);
     }
 
-    return path.parent_path().filename();
+    if (file.modified) {
+        auto entry = readDirectoryEntry(file.path);
+        entry.firstBlockAddress = file.firstBlockAddress;
+        entry.attributes.size = file.size;
+        entry.attributes.lastModified = getNow();
+        writeDirectoryEntry(file.path, entry);
+    }
 }
 
-FAT12::Path FAT12::parentPath(const Path& path) {
-    assert(!path.empty());
+void FAT12::abandon(FileHandle handle) noexcept {
+    try {
+        if (!openFile(handle).created) {
+            // The chain and size written so far stay consistent with each other.
+            close(handle);
+            return;
+        }
 
-    if (path == path.root_path()) {
-        return "";
+        Operation operation(*this);
+        auto& openedFile = openFile(handle);
+        DirectoryLocks::Guard guard(directoryLocks);
+        guard.lock(parentPath(openedFile.path), true);
+
+        OpenFile file;
+        {
+            std::lock_guard lock(openFilesMutex);
+            auto it = openFiles.find(handle);
+            file = std::move(it->second);
+            openFiles.erase(it);
+        }
+        freeBlocks(file.firstBlockAddress);
+        removeDirectoryEntry(file.path);
+    } catch (...) {
     }
+}
 
-    return path.parent_path();
+size_t FAT12::size(FileHandle handle) {
+    return openFile(handle).size;
 }
 
-void FAT12::writeSuperblock() {
-    std::vector<char> buffer;
-    serialize(buffer, sb.partitionId);
-    serialize(buffer, sb.blockSize);
-    serialize(buffer, sb.rootDirectoryEntrySize);
+std::string FAT12::dump() {
+    std::ostringstream oss;
 
-    // Write superblock to sector 0.
-    std::array<char, Disk::sectorSize> sector;
-    std::copy_n(buffer.begin(), buffer.size(), sector.begin());
-    disk.write(0, sector);
-}
+    size_t freeBlockCount;
+    {
+        std::shared_lock fatLock(fatMutex);
+        freeBlockCount = freeSpace.freeCount();
+    }
 
-void FAT12::readSuperblock() {
-    // Read superblock from sector 0.
-    auto sector = disk.read(0);
+    int fileCount = 0;
+    int directoryCount = 0;
+    std::string directoryDump = dumpDirectory("", 0, fileCount, directoryCount);
 
-    std::vector<char> buffer(sector.begin(), sector.end());
-    size_t offset = 0;
-    deserialize(buffer, offset, sb.partitionId);
-    deserialize(buffer, offset, sb.blockSize);
-    deserialize(buffer, offset, sb.rootDirectoryEntrySize);
+    oss << "Block count: " << fat.size() << std::endl;
+    oss << "Free blocks: " << freeBlockCount << std::endl;
+    oss << "Block size: " << sb.blockSize << std::endl;
+    oss << "File count: " << fileCount << std::endl;
+    oss << "Directory count: " << directoryCount << std::endl;
+    oss << directoryDump;
+
+    return oss.str();
 }
 
-void FAT12::writeFat() {
-    std::vector<char> buffer;
+void FAT12::flush() {
+    assert(threadOperationDepth == 0);
+    std::unique_lock lock(operationMutex);
 
-    for (BlockAddress blockAddress : fat) {
-        serialize(buffer, blockAddress);
+    // Hold back new operations until the ones in progress return.
+    while (activeOperations > 0) {
+        flushPending = true;
+        operationsDone.wait(lock);
     }
 
-    for (BlockAddress blockAddress = fatAddress(); blockAddress < dataAddress(); blockAddress++) {
-        auto begin = buffer.begin() + blockAddress * sb.blockSize;
-        std::vector<char> block(begin, begin + sb.blockSize);
-        writeBlock(blockAddress, block);
+    // Operations wait for flushPending to clear, so it is cleared even if the flush fails.
+    std::exception_ptr error;
+    try {
+        flushBlocks();
+    } catch (...) {
+        error = std::current_exception();
     }
-}
-
-void FAT12::readFat() {
-    std::vector<char> buffer;
-    size_t offset = 0;
+    flushPending = false;
+    operationsDone.notify_all();
 
-    for (BlockAddress blockAddress = fatAddress(); blockAddress < dataAddress(); blockAddress++) {
-        std::vector<char> block = readBlock(blockAddress);
-        buffer.insert(buffer.end(), block.begin(), block.end());
+    // Report a failed flush of an earlier operation too, unless this one failed as well.
+    if (auto earlier = std::exchange(flushError, nullptr); !error) {
+        error = earlier;
     }
-    
-    for (BlockAddress& blockAddress : fat) {
-        deserialize(buffer, offset, blockAddress);
+    if (error) {
+        std::rethrow_exception(error);
     }
 }
 
-void FAT12::writeBlock(BlockAddress blockAddress, const std::vector<char>& block) {
-    assert(blockAddress >= 0 && blockAddress <= maxAddress());
-    assert(block.size() == sb.blockSize);
-
-    size_t sectorPerBlock = sb.blockSize / Disk::sectorSize;
-    size_t startAddress = 1 + blockAddress * sectorPerBlock; // Blocks start at sector 1, after superblock.
-
-    for (size_t offset = 0; offset < sectorPerBlock; offset++) {
-        std::array<char, Disk::sectorSize> sector;
-        std::copy_n(block.begin() + offset * Disk::sectorSize, Disk::sectorSize, sector.begin());
-        disk.write(startAddress + offset, sector);
-    }
+void FAT12::beginBatch() {
+    std::lock_guard lock(operationMutex);
+    batchDepth++;
 }
 
-std::vector<char> FAT12::readBlock(BlockAddress blockAddress) {
-    assert(blockAddress >= 0 && blockAddress <= maxAddress());
+void FAT12::endBatch() {
+    {
+        std::lock_guard lock(operationMutex);
+        assert(batchDepth > 0);
+        if (--batchDepth > 0) {
+            return;
+        }
+    }
 
-    std::vector<char> block(sb.blockSize);
+    flush();
+}
 
-    size_t sectorPerBlock = sb.blockSize / Disk::sectorSize;
-    size_t startAddress = 1 + blockAddress * sectorPerBlock; // Blocks start at sector 1, after superblock.
-    
-    for (size_t offset = 0; offset < sectorPerBlock; offset++) {
-        auto sector = disk.read(startAddress + offset);
-        std::copy_n(sector.begin(), Disk::sectorSize, block.begin() + offset * Disk::sectorSize);
+void FAT12::beginOperation() {
+    if (threadOperationDepth++ > 0) {
+        return;
     }
 
-    return block;
+    std::unique_lock lock(operationMutex);
+    operationsDone.wait(lock, [&] { return !flushPending; });
+    activeOperations++;
 }
 
-FAT12::BlockAddress FAT12::writeBlocks(BlockAddress blockAddress, const std::vector<char>& buffer) {
-    if (blockAddress == lastBlockMarker()) {
-        // No existing blocks, start checking for free blocks from the beginning of data blocks.
-        blockAddress = dataAddress();
-    } else {
-        // Free existing blocks from the specified address so that we can write to it.
-        freeBlocks(blockAddress);
+void FAT12::endOperation(bool flushes) {
+    if (--threadOperationDepth > 0) {
+        return;
     }
 
-    if (buffer.empty()) {
-        return lastBlockMarker();
+    std::lock_guard lock(operationMutex);
+    activeOperations--;
+    if (flushes && batchDepth == 0) {
+        flushPending = true;
     }
 
-    BlockAddress currAddress = blockAddress;
-    BlockAddress prevAddress = -1;
-    BlockAddress firstAddress = -1;
-    size_t offset = 0;
-    while (true) {
-        if (fat[currAddress] == freeBlockMarker()) {
-            // Free block was found, write next block in buffer to it.
-            auto begin = buffer.begin() + offset;
-            std::vector<char> block(begin, std::min(begin + sb.blockSize, buffer.end()));
-            block.resize(sb.blockSize);
-            offset += sb.blockSize;
-            writeBlock(currAddress, block);
-
-            // Save firstBlockAddress.
-            if (firstAddress == -1) {
-                firstAddress = currAddress;
-            }
-
-            // Form link between previous block and current block in FAT.
-            if (prevAddress != -1) {
-                fat[prevAddress] = currAddress;
-            }
-            prevAddress = currAddress;
-
-            // If everything in buffer is written, save fat and return.
-            if (offset >= buffer.size()) {
-                fat[currAddress] = lastBlockMarker();
-                writeFat();
-                return firstAddress;
+    // The last operation to return flushes for all of them. This runs in the destructor of Operation, possibly
+    // while an exception unwinds, so a failed flush is kept for flush to throw.
+    if (activeOperations == 0) {
+        if (flushPending) {
+            try {
+                flushBlocks();
+            } catch (...) {
+                flushError = std::current_exception();
             }
         }
-
-        // Go to next block and check if we looped to where we began.
-        currAddress = (currAddress + 1) % fat.size();
-        if (currAddress == blockAddress) {
-            throw std::runtime_error("File system is full.");
-        }
+        flushPending = false;
+        operationsDone.notify_all();
     }
 }
 
-std::vector<char> FAT12::readBlocks(BlockAddress blockAddress) {
-    assert(blockAddress >= dataAddress() && blockAddress <= maxAddress() || blockAddress == lastBlockMarker());
+void FAT12::flushBlocks() {
+    std::lock_guard lock(metadataMutex);
 
-    std::vector<char> buffer;
+    writeFat();
+    std::unique_lock cacheLock(cacheMutex);
+    for (auto& block : cache.takeDirty()) {
+        uncommittedBlocks[block.address] = std::move(block.data);
+    }
+    cacheLock.unlock();
+    commit();
 
-    while (blockAddress != lastBlockMarker()) {
-        auto block = readBlock(blockAddress);
-        buffer.insert(buffer.end(), block.begin(), block.end());
-        blockAddress = fat[blockAddress];
+    if (superblockDirty) {
+        writeSuperblock();
+        superblockDirty = false;
     }
 
-    return buffer;
+    disk.sync();
 }
 
-void FAT12::freeBlocks(const Path& path) {
-    auto [address, _] = pathToAddressAndSize(path);
-    freeBlocks(address);
+void FAT12::setCacheCapacity(size_t capacity) {
+    std::lock_guard lock(metadataMutex);
+    std::unique_lock cacheLock(cacheMutex);
+    keepUncommitted(cache.setCapacity(capacity));
 }
 
-void FAT12::freeBlocks(BlockAddress blockAddress) {
-    assert(blockAddress >= dataAddress() && blockAddress <= maxAddress() || blockAddress == lastBlockMarker());
-
-    while (blockAddress != lastBlockMarker()) {
-        BlockAddress nextAddress = fat[blockAddress];
-        fat[blockAddress] = freeBlockMarker();
-        blockAddress = nextAddress;
+void FAT12::commit() {
+    if (uncommittedBlocks.empty()) {
+        return;
     }
 
-    writeFat();
-}
+    std::vector<size_t> addresses;
+    std::vector<std::span<const char>> blocks;
+    for (auto& [address, data] : uncommittedBlocks) {
+        addresses.push_back(address);
+        blocks.push_back(data);
+    }
 
-void FAT12::writeDirectoryEntry(const Path& path, const DirectoryEntry& directoryEntry) {
-    auto parent = readDirectory(parentPath(path));
-    std::string name = pathToName(path);
+    // Make room by checkpointing when the journal is full.
+    if (!journal->fits(blocks.size())) {
+        checkpoint();
+    }
 
-    for (auto& entry : parent) {
-        if (entry.attributes.name == name) {
-            entry = directoryEntry;
-            writeDirectory(parentPath(path), parent);
-            return;
+    if (journal->fits(blocks.size())) {
+        journal->commit(addresses, blocks);
+        for (auto& [address, data] : uncommittedBlocks) {
+            checkpointBlocks[address] = std::move(data);
+        }
+    } else {
+        // Larger than the whole journal, so it is written in place without the journal's atomicity.
+        std::vector<BlockCache::Block> homeBlocks;
+        for (auto& [address, data] : uncommittedBlocks) {
+            homeBlocks.push_back({.address = (size_t)address, .data = std::move(data)});
         }
+        writeBack(homeBlocks);
     }
 
-    throw NoSuchFileOrDirectoryException(path);
+    uncommittedBlocks.clear();
 }
 
-FAT12::DirectoryEntry FAT12::readDirectoryEntry(const Path& path) {
-    auto parent = readDirectory(parentPath(path));
-    std::string name = pathToName(path);
-
-    for (auto& entry : parent) {
-        if (entry.attributes.name == name) {
-            return entry;
-        }
+void FAT12::checkpoint() {
+    std::lock_guard lock(metadataMutex);
+    std::vector<BlockCache::Block> blocks;
+    for (auto& [address, data] : checkpointBlocks) {
+        blocks.push_back({.address = (size_t)address, .data = std::move(data)});
     }
 
-    throw NoSuchFileOrDirectoryException(path);
+    writeBack(blocks);
+    disk.sync();
+    journal->reset();
+    checkpointBlocks.clear();
 }
 
-FAT12::BlockAddress FAT12::writeDirectory(const Path& path, const std::vector<DirectoryEntry>& directory, bool updateLastModified) {
-    checkIsDirectory(path, true);
-
-    std::vector<char> buffer;
-
-    for (auto& entry : directory) {
-        serialize(buffer, entry.attributes.isDirectory);
-        serialize(buffer, entry.attributes.name);
-        serialize(buffer, entry.attributes.size);
-        serialize(buffer, entry.attributes.canRead);
-        serialize(buffer, entry.attributes.canWrite);
-        serialize(buffer, entry.attributes.created);
-        serialize(buffer, entry.attributes.lastModified);
-        serialize(buffer, entry.firstBlockAddress);
+const std::vector<char>* FAT12::journaledBlock(BlockAddress blockAddress) const {
+    if (auto it = uncommittedBlocks.find(blockAddress); it != uncommittedBlocks.end()) {
+        return &it->second;
     }
+    if (auto it = checkpointBlocks.find(blockAddress); it != checkpointBlocks.end()) {
+        return &it->second;
+    }
+    return nullptr;
+}
 
-    auto [address, _] = pathToAddressAndSize(path);
-    address = writeBlocks(address, buffer);
+void FAT12::keepUncommitted(std::vector<BlockCache::Block> blocks) {
+    for (auto& block : blocks) {
+        uncommittedBlocks[block.address] = std::move(block.data);
+    }
+}
 
-    // Update directory's directory entry.
-    if (path.empty()) {
-        sb.rootDirectoryEntrySize = buffer.size();
-        writeSuperblock();
-    } else {
-        auto entry = readDirectoryEntry(path);
-        bool updated = false;
+FAT12::Stats FAT12::stats() const {
+    std::lock_guard lock(metadataMutex);
+    return {
+        .disk = disk.stats(),
+        .cache = cache.stats(),
+        .readBlock = readBlockCalls.value(),
+        .writeBlock = writeBlockCalls.value(),
+        .writeFat = writeFatCalls.value(),
+        .readDirectory = readDirectoryCalls.value(),
+        .writeDirectory = writeDirectoryCalls.value(),
+        .pathToAddressAndSize = pathToAddressAndSizeCalls.value()
+    };
+}
 
-        if (entry.attributes.size != buffer.size() || entry.firstBlockAddress != address) {
-            entry.attributes.size = buffer.size();
-            entry.firstBlockAddress = address;
-            updated = true;
-        }
+void FAT12::setTrace(Trace* trace) {
+    this->trace = trace;
+    disk.setTrace(trace);
+}
 
-        if (updateLastModified) {
-            entry.attributes.lastModified = getNow();
-            updated = true;
+std::string FAT12::dumpDirectory(const Path& path, int indent, int& fileCount, int& directoryCount) {
+    std::ostringstream oss;
+    // The parent is still locked by the caller, so the locks are taken top down.
+    DirectoryLocks::Guard guard(directoryLocks);
+    guard.lock(path, false);
+    checkIsDirectory(path, true);
+    auto directory = readDirectoryEntry(path);
+
+    // Entries are read in place from a copy of each block, which subdirectories are dumped without holding.
+    std::vector<char> block(sb.blockSize);
+    DirectoryEntry entry;
+    size_t slotCount = directory.attributes.size / directoryEntrySize;
+    BlockAddress blockAddress = directory.firstBlockAddress;
+    for (size_t slot = 0; slot < slotCount; slot += entriesPerBlock(), blockAddress = chainAddress(blockAddress, 1)) {
+        size_t blockSlotCount = std::min(entriesPerBlock(), slotCount - slot);
+        visitBlock(blockAddress, [&](const std::vector<char>& cached) {
+            std::copy(cached.begin(), cached.end(), block.begin());
+        });
+
+        for (auto view : DirectoryView(*this, std::span<const char>(block).first(blockSlotCount * directoryEntrySize), slot)) {
+            if (!EntryLayout::decode(view.bytes, entry)) {
+                throw CorruptImageException(diskPath);
+            }
+
+            std::shared_lock fatLock(fatMutex);
+            oss << std::string(indent, ' ');
+            oss << view.name << " ";
+
+            // Write contiguous addresses with a dash between begin and end addresses.
+            // Write "->" to denote jumping to a noncontiguous address.
+            BlockAddress beginAddress = entry.firstBlockAddress;
+            if (beginAddress != -1) {
+                oss << beginAddress;
+            }
+            for (BlockAddress address = entry.firstBlockAddress; address != lastBlockMarker(); address = fat[address]) {
+                checkChainAddress(address);
+                if (fat[address] != address + 1) {
+                    if (address != beginAddress) {
+                        oss << "-" << address;
+                    }
+                    if (fat[address] != lastBlockMarker()) {
+                        oss << "->" << fat[address];
+                        beginAddress = fat[address];
+                    }
+                }
+            }
+
+            oss << std::endl;
+            fatLock.unlock();
+
+            if (entry.attributes.isDirectory) {
+                directoryCount++;
+                oss << dumpDirectory(path/view.name, indent + 2, fileCount, directoryCount);
+            } else {
+                fileCount++;
+            }
+        }
+    }
+
+    return oss.str();
+}
+
+struct FAT12::CheckState {
+    bool repair;
+    CheckReport report;
+    std::vector<bool> owned;
+
+    // A directory whose slots are still to be checked, and the slot of its entry in its parent.
+    struct Directory {
+        Path path;
+        DirectoryEntry entry;
+        BlockAddress parentAddress = lastBlockMarker();
+        size_t slot = 0;
+        bool changed = false;
+    };
+    std::vector<Directory> pending;
+    std::vector<Directory> unindexed;
+
+    // Problems of the image as a whole, and of the directory that contains root directory entry, are reported
+    // with the path of the image.
+    std::string imagePath;
+
+    void problem(const Path& path, const std::string& message) {
+        report.problems.push_back((path.empty() ? imagePath : path.string()) + ": " + message);
+    }
+};
+
+FAT12::CheckReport FAT12::check(bool repair) {
+    Operation operation(*this);
+    DirectoryLocks::Guard guard(directoryLocks);
+    guard.lock("", true);
+    std::lock_guard lock(metadataMutex);
+    {
+        // Repairs rewrite chains that a handle may be positioned in.
+        std::lock_guard openFilesLock(openFilesMutex);
+        if (repair && !openFiles.empty()) {
+            throw FileInUseException(openFiles.begin()->second.path);
+        }
+    }
+
+    CheckState state = {
+        .repair = repair,
+        .report = {},
+        .owned = std::vector<bool>(fat.size()),
+        .pending = {},
+        .unindexed = {},
+        .imagePath = diskPath
+    };
+    // Repairs rewrite slots directly, behind the back of cached directories.
+    {
+        std::unique_lock cacheLock(cacheMutex);
+        directoryCache.clear();
+    }
+
+    // The FAT, the directory that contains root directory entry and the journal belong to no chain.
+    auto claimReserved = [&](BlockAddress blockAddress) {
+        state.owned[blockAddress] = true;
+        if (fat[blockAddress] != lastBlockMarker()) {
+            state.problem("", "reserved block " + std::to_string(blockAddress) + " is not marked in use");
+            if (repair) {
+                std::unique_lock fatLock(fatMutex);
+                setFat(blockAddress, lastBlockMarker());
+            }
+        }
+    };
+    for (BlockAddress blockAddress = fatAddress(); blockAddress <= dataAddress(); blockAddress++) {
+        claimReserved(blockAddress);
+    }
+    for (size_t i = 0; i < sb.journalBlockCount; i++) {
+        claimReserved(sb.journalAddress + i);
+    }
+
+    // Directories wait on a stack rather than the call stack, so deep trees cannot overflow it.
+    state.pending.push_back({
+        .path = "",
+        .entry = {
+            .attributes = {.isDirectory = true, .size = sb.rootDirectoryEntrySize, .created = 0, .lastModified = 0},
+            .firstBlockAddress = dataAddress()
+        }
+    });
+    while (!state.pending.empty()) {
+        auto directory = std::move(state.pending.back());
+        state.pending.pop_back();
+
+        // The size was fitted to the claimed part of the chain, so no slot is read from a block of another chain.
+        auto chain = chainAddresses(directory.entry.firstBlockAddress, blockCount(directory.entry.attributes.size));
+        std::vector<char> slots(chain.size() * sb.blockSize);
+        readBlocks(chain, slots, true);
+        slots.resize(directory.entry.attributes.size);
+
+        if (checkDirectory(state, directory.path, directory.entry, slots, directory.changed)) {
+            state.unindexed.push_back(directory);
+        }
+        if (directory.changed && repair && directory.parentAddress != lastBlockMarker()) {
+            writeDirectory(directory.parentAddress, directory.slot, directory.entry);
+        }
+    }
+
+    {
+        std::unique_lock fatLock(fatMutex);
+        for (BlockAddress blockAddress = 0; blockAddress <= maxAddress(); blockAddress++) {
+            if (state.owned[blockAddress] || fat[blockAddress] == freeBlockMarker()) {
+                continue;
+            }
+
+            state.report.orphanedBlockCount++;
+            if (repair) {
+                setFat(blockAddress, freeBlockMarker());
+                std::unique_lock cacheLock(cacheMutex);
+                cache.discard(blockAddress);
+                uncommittedBlocks.erase(blockAddress);
+            }
+        }
+    }
+    if (state.report.orphanedBlockCount > 0) {
+        state.problem("", std::to_string(state.report.orphanedBlockCount) + " blocks are in use but belong to no file or directory");
+    }
+
+    if (repair) {
+        for (auto& directory : state.unindexed) {
+            buildIndex(directory.path, directory.entry);
+            writeDirectory(directory.parentAddress, directory.slot, directory.entry);
+        }
+        std::unique_lock cacheLock(cacheMutex);
+        directoryCache.clear();
+    }
+
+    std::shared_lock fatLock(fatMutex);
+    state.report.usedBlockCount = fat.size() - freeSpace.freeCount();
+    return state.report;
+}
+
+FAT12::ClaimedChain FAT12::claimChain(CheckState& state, BlockAddress firstBlockAddress, size_t maxBlockCount) {
+    ClaimedChain chain;
+    std::shared_lock fatLock(fatMutex);
+
+    for (BlockAddress blockAddress = firstBlockAddress; blockAddress != lastBlockMarker(); blockAddress = fat[blockAddress]) {
+        if (chain.blocks.size() == maxBlockCount) {
+            chain.problem = "chain is longer than the size";
+        } else if (blockAddress < dataAddress() || blockAddress > maxAddress()) {
+            chain.problem = "chain leaves the data area at block " + std::to_string(blockAddress);
+        } else if (state.owned[blockAddress]) {
+            chain.problem = "chain loops or is cross-linked at block " + std::to_string(blockAddress);
+        } else if (fat[blockAddress] == freeBlockMarker()) {
+            chain.problem = "chain runs into free block " + std::to_string(blockAddress);
+        }
+        if (chain.problem) {
+            break;
+        }
+
+        state.owned[blockAddress] = true;
+        chain.blocks.push_back(blockAddress);
+    }
+
+    return chain;
+}
+
+bool FAT12::checkChain(CheckState& state, const Path& path, DirectoryEntry& entry) {
+    auto& attributes = entry.attributes;
+    bool changed = false;
+
+    if (attributes.isDirectory && attributes.size % directoryEntrySize != 0) {
+        state.problem(path, "size " + std::to_string(attributes.size) + " is not a whole number of slots");
+        attributes.size -= attributes.size % directoryEntrySize;
+        changed = true;
+    }
+    // The blocks of a stray index are freed as orphans.
+    if (!attributes.isDirectory && (entry.indexBlockAddress != lastBlockMarker() || entry.freeSlotHead != 0)) {
+        state.problem(path, "file has a name index or free slot list");
+        entry.indexBlockAddress = lastBlockMarker();
+        entry.freeSlotHead = 0;
+        changed = true;
+    }
+
+    // Blocks after the last claimed one are freed as orphans, unless a chain checked later claims them.
+    auto chain = claimChain(state, entry.firstBlockAddress, blockCount(attributes.size));
+    if (chain.problem) {
+        state.problem(path, *chain.problem);
+        if (chain.blocks.empty()) {
+            entry.firstBlockAddress = lastBlockMarker();
+            changed = true;
+        } else if (state.repair) {
+            std::unique_lock fatLock(fatMutex);
+            setFat(chain.blocks.back(), lastBlockMarker());
+        }
+    }
+
+    size_t chainSize = chain.blocks.size() * sb.blockSize;
+    if (chainSize < attributes.size) {
+        if (!chain.problem) {
+            state.problem(path, "size is " + std::to_string(attributes.size) + " bytes but the chain ends after " + std::to_string(chain.blocks.size()) + " blocks");
+        }
+        attributes.size = chainSize;
+        changed = true;
+    }
+
+    return changed;
+}
+
+bool FAT12::checkDirectory(CheckState& state, const Path& path, DirectoryEntry& entry, const std::vector<char>& slots, bool& changed) {
+    size_t slotCount = slots.size() / directoryEntrySize;
+    std::vector<bool> used(slotCount);
+    std::vector<size_t> unusedSlots;
+    size_t freeCount = 0;
+    std::unordered_set<std::string_view> names;
+
+    for (size_t slot = 0; slot < slotCount; slot++) {
+        auto bytes = std::span<const char>(slots).subspan(slot * directoryEntrySize, directoryEntrySize);
+        if (schema::load<uint8_t>(bytes.data()) == unusedSlot) {
+            unusedSlots.push_back(slot);
+            freeCount++;
+            continue;
+        }
+
+        std::optional<DirectoryEntry> child;
+        try {
+            child = deserializeEntry(bytes);
+        } catch (const CorruptImageException&) {
+        }
+
+        // The directory that contains root directory entry holds nothing else.
+        std::string problem;
+        auto name = NameField::view(bytes.data() + nameOffset);
+        if (!child) {
+            problem = "slot " + std::to_string(slot) + " holds an invalid entry";
+        } else if (path.empty() ? *name != "/" || !child->attributes.isDirectory : name->empty() || name->find('/') != name->npos) {
+            problem = "slot " + std::to_string(slot) + " holds an invalid name";
+        } else if (!names.insert(*name).second) {
+            problem = "slot " + std::to_string(slot) + " repeats the name " + child->attributes.name;
+        }
+
+        if (!problem.empty()) {
+            state.problem(path, problem);
+
+            // Nothing is reachable without root directory entry, so an empty root directory takes its place.
+            if (path.empty()) {
+                auto now = getNow();
+                child = {.attributes = {.isDirectory = true, .name = "/", .created = now, .lastModified = now}};
+                if (state.repair) {
+                    writeDirectory(entry.firstBlockAddress, slot, child);
+                }
+            } else {
+                if (state.repair) {
+                    writeDirectory(entry.firstBlockAddress, slot, std::nullopt);
+                    unusedSlots.push_back(slot);
+                }
+                continue;
+            }
+        }
+
+        used[slot] = true;
+        Path childPath = path/child->attributes.name;
+        bool childChanged = checkChain(state, childPath, *child);
+        if (child->attributes.isDirectory) {
+            state.report.directoryCount++;
+            state.pending.push_back({childPath, *child, entry.firstBlockAddress, slot, childChanged});
+        } else {
+            state.report.fileCount++;
+            if (childChanged && state.repair) {
+                writeDirectory(entry.firstBlockAddress, slot, *child);
+            }
+        }
+    }
+
+    // Every unused slot is on the free slot list once. Slots cleared above are not on it yet.
+    std::vector<bool> listed(slotCount);
+    size_t listedCount = 0;
+    bool broken = false;
+    for (uint32_t next = entry.freeSlotHead; next != 0;) {
+        size_t slot = next - 1;
+        FreeSlot freeSlot;
+        if (slot >= slotCount || listed[slot] || !FreeSlotLayout::decode(std::span<const char>(slots).subspan(slot * directoryEntrySize), freeSlot)) {
+            broken = true;
+            break;
+        }
+
+        listed[slot] = true;
+        listedCount++;
+        next = freeSlot.nextFreeSlot;
+    }
+
+    if (broken) {
+        state.problem(path, "free slot list is broken");
+    } else if (listedCount < freeCount) {
+        state.problem(path, std::to_string(freeCount - listedCount) + " unused slots are not on the free slot list");
+    }
+    if ((broken || listedCount < unusedSlots.size()) && state.repair) {
+        std::sort(unusedSlots.begin(), unusedSlots.end());
+        uint32_t next = 0;
+        for (auto it = unusedSlots.rbegin(); it != unusedSlots.rend(); it++) {
+            writeDirectory(entry.firstBlockAddress, *it, std::nullopt, next);
+            next = *it + 1;
+        }
+        entry.freeSlotHead = next;
+        changed = true;
+    }
+
+    // Directories get a name index once they outgrow one block.
+    bool needsIndex = slotCount > entriesPerBlock();
+    if (entry.indexBlockAddress != lastBlockMarker()) {
+        if (checkIndex(state, entry, slots, used)) {
+            return false;
+        }
+        state.problem(path, "name index is invalid");
+        entry.indexBlockAddress = lastBlockMarker();
+        changed = true;
+    } else if (needsIndex) {
+        state.problem(path, "name index is missing");
+    }
+
+    return needsIndex;
+}
+
+bool FAT12::checkIndex(CheckState& state, const DirectoryEntry& directory, const std::vector<char>& slots, const std::vector<bool>& used) {
+    BlockAddress firstBlockAddress = directory.indexBlockAddress;
+    if (firstBlockAddress < dataAddress() || firstBlockAddress > maxAddress() || state.owned[firstBlockAddress]) {
+        return false;
+    }
+
+    IndexHeader header;
+    if (!IndexHeaderLayout::decode(readBlock(firstBlockAddress), header) || header.bucketCount == 0 ||
+        (header.bucketCount & (header.bucketCount - 1)) != 0 || header.bucketCount > fat.size() * sb.blockSize / indexBucketSize) {
+        return false;
+    }
+
+    size_t indexBlockCount = blockCount(indexHeaderSize + (size_t)header.bucketCount * indexBucketSize);
+    auto chain = claimChain(state, firstBlockAddress, indexBlockCount);
+    bool valid = !chain.problem && chain.blocks.size() == indexBlockCount;
+
+    if (valid) {
+        std::vector<char> index(indexBlockCount * sb.blockSize);
+        readBlocks(chain.blocks, index, true);
+        std::vector<IndexBucket> buckets(header.bucketCount);
+        for (size_t bucket = 0; bucket < buckets.size(); bucket++) {
+            IndexBucketLayout::decode(std::span<const char>(index).subspan(indexHeaderSize + bucket * indexBucketSize), buckets[bucket]);
+        }
+
+        // Probing stops at empty buckets, so an entry is only found if no empty bucket lies between its hash and
+        // it. Runs of used buckets are counted from an empty one on.
+        uint32_t mask = header.bucketCount - 1;
+        auto empty = std::find_if(buckets.begin(), buckets.end(), [](const IndexBucket& value) { return value.slot == emptyBucket; });
+        valid = empty != buckets.end();
+
+        std::vector<bool> indexed(used.size());
+        size_t entryCount = 0;
+        size_t usedBucketCount = 0;
+        size_t run = 0;
+        for (uint32_t i = 1; valid && i <= header.bucketCount; i++) {
+            uint32_t bucket = (uint32_t)(empty - buckets.begin() + i) & mask;
+            auto& value = buckets[bucket];
+            if (value.slot == emptyBucket) {
+                run = 0;
+                continue;
+            }
+            run++;
+            usedBucketCount++;
+            if (value.slot == deletedBucket) {
+                continue;
+            }
+
+            size_t slot = value.slot - firstSlotBucket;
+            valid = slot < used.size() && used[slot] && !indexed[slot] &&
+                nameHash(*NameField::view(slots.data() + slot * directoryEntrySize + nameOffset)) == value.hash &&
+                ((bucket - value.hash) & mask) < run;
+            if (valid) {
+                indexed[slot] = true;
+                entryCount++;
+            }
+        }
+
+        valid = valid && entryCount == (size_t)std::count(used.begin(), used.end(), true) &&
+            header.entryCount == entryCount && header.usedBucketCount == usedBucketCount;
+    }
+
+    // An invalid index is freed with the orphans.
+    if (!valid) {
+        for (auto blockAddress : chain.blocks) {
+            state.owned[blockAddress] = false;
+        }
+    }
+
+    return valid;
+}
+
+FAT12::DefragmentReport FAT12::defragment(const Path& path, size_t maxBlockCount) {
+    DefragmentReport report;
+    auto chains = chainFragments(path);
+    report.chainCount = chains.size();
+    for (auto& chain : chains) {
+        report.fragmentsBefore += chain.fragmentCount;
+        report.fragmentedChainsBefore += chain.fragmentCount > 1;
+    }
+
+    // Moved chains leave free runs behind that may fit chains that did not fit before, so passes repeat until
+    // one moves nothing. Every move leaves a chain in fewer runs, so they end.
+    for (bool moved = true; moved; chains = chainFragments(path)) {
+        moved = false;
+
+        // The most fragmented chains gain the most from a move, so a bounded run moves them first.
+        std::stable_sort(chains.begin(), chains.end(), [](const ChainFragments& a, const ChainFragments& b) {
+            return a.fragmentCount > b.fragmentCount;
+        });
+
+        for (auto& chain : chains) {
+            if (chain.fragmentCount < 2) {
+                break;
+            }
+
+            size_t movedBlockCount = moveChain(chain, maxBlockCount - report.movedBlockCount);
+            if (movedBlockCount > 0) {
+                moved = true;
+                report.movedChainCount++;
+                report.movedBlockCount += movedBlockCount;
+
+                // Old blocks of a chain may only take data of the next one once the move is committed.
+                flush();
+            }
+        }
+    }
+
+    for (auto& chain : chains) {
+        report.fragmentsAfter += chain.fragmentCount;
+        report.fragmentedChainsAfter += chain.fragmentCount > 1;
+    }
+
+    return report;
+}
+
+std::vector<FAT12::ChainFragments> FAT12::chainFragments(const Path& path) {
+    std::vector<ChainFragments> chains;
+    std::vector<Path> directories;
+
+    auto addChains = [&](const Path& entryPath, const DirectoryEntry& entry) {
+        if (entry.firstBlockAddress != lastBlockMarker()) {
+            chains.push_back({entryPath, false, chainExtents(entry.firstBlockAddress).size()});
+        }
+        if (entry.indexBlockAddress != lastBlockMarker()) {
+            chains.push_back({entryPath, true, chainExtents(entry.indexBlockAddress).size()});
+        }
+        if (entry.attributes.isDirectory) {
+            directories.push_back(entryPath);
+        }
+    };
+
+    {
+        DirectoryLocks::Guard guard(directoryLocks);
+        guard.lock(parentPath(path), false);
+        addChains(path, readDirectoryEntry(path));
+    }
+
+    // Each directory is locked only while it is listed, so the walk does not hold up writers for long.
+    while (!directories.empty()) {
+        Path directory = std::move(directories.back());
+        directories.pop_back();
+
+        // A directory deleted or replaced since it was found has no chains left to move, like in moveChain.
+        DirectoryLocks::Guard guard(directoryLocks);
+        guard.lock(directory, false);
+        std::vector<DirectoryEntry> entries;
+        try {
+            entries = readDirectory(directory);
+        } catch (const FileSystemException&) {
+            continue;
+        }
+        for (auto& entry : entries) {
+            addChains(directory/entry.attributes.name, entry);
+        }
+    }
+
+    return chains;
+}
+
+size_t FAT12::moveChain(const ChainFragments& chain, size_t maxBlockCount) {
+    Operation operation(*this);
+    DirectoryLocks::Guard guard(directoryLocks);
+    guard.lock(parentPath(chain.path), true);
+    std::lock_guard lock(metadataMutex);
+
+    // The tree may have changed since the chain was found.
+    DirectoryEntry entry;
+    try {
+        entry = readDirectoryEntry(chain.path);
+    } catch (const FileSystemException&) {
+        return 0;
+    }
+    if (isOpen(chain.path)) {
+        return 0;
+    }
+
+    BlockAddress& firstBlockAddress = chain.isIndex ? entry.indexBlockAddress : entry.firstBlockAddress;
+    auto oldChain = chainAddresses(firstBlockAddress);
+    size_t oldFragmentCount = chainExtents(firstBlockAddress).size();
+    if (oldFragmentCount < 2 || oldChain.size() > maxBlockCount) {
+        return 0;
+    }
+
+    std::vector<FreeSpace::Extent> extents;
+    {
+        std::unique_lock fatLock(fatMutex);
+        if (oldChain.size() > freeSpace.freeCount()) {
+            return 0;
+        }
+        extents = freeSpace.findExtents(oldChain.size());
+        if (extents.size() >= oldFragmentCount) {
+            return 0;
+        }
+
+        BlockAddress prevAddress = lastBlockMarker();
+        for (auto& extent : extents) {
+            prevAddress = linkExtent(extent, prevAddress);
+        }
+    }
+
+    // Directories and name indexes are read through the cache for their latest slots. Every chain is then written
+    // straight to its new blocks, which nothing points at yet, and synced, so the transaction only holds the FAT
+    // and the entry and a large directory does not outgrow the journal.
+    std::vector<char> data(oldChain.size() * sb.blockSize);
+    readBlocks(oldChain, data, entry.attributes.isDirectory);
+
+    checkpointReusedBlocks(extents);
+    size_t offset = 0;
+    for (auto& extent : extents) {
+        writeExtent(extent.address, std::span<const char>(data).subspan(offset, extent.length * sb.blockSize));
+        offset += extent.length * sb.blockSize;
+    }
+    disk.sync();
+
+    BlockAddress oldFirstBlockAddress = firstBlockAddress;
+    firstBlockAddress = extents.front().address;
+    writeDirectoryEntry(chain.path, entry);
+    freeBlocks(oldFirstBlockAddress);
+
+    return oldChain.size();
+}
+
+void FAT12::checkIsDirectory(const Path& path, bool shouldBeDirectory) {
+    bool isDirectory = path.empty() || readAttributes(path).isDirectory;
+    if (shouldBeDirectory && !isDirectory) {
+        throw NotADirectoryException(path);
+    }
+    if (!shouldBeDirectory && isDirectory) {
+        throw IsADirectoryException(path);
+    }
+}
+
+void FAT12::checkPermission(const Path& path, const std::string& permission) {
+    assert(permission == "r" || permission == "w");
+
+    // The directory that contains root directory entry has no attributes.
+    if (path.empty()) {
+        return;
+    }
+
+    auto attributes = readAttributes(path);
+    if (permission == "r" && !attributes.canRead || permission == "w" && !attributes.canWrite) {
+        throw PermissionException(path);
+    }
+}
+
+FAT12::Path FAT12::pathToName(const Path& path) {
+    assert(!path.empty());
+
+    if (path == path.root_path()) {
+        return "/";
+    }
+
+    if (path.has_filename()) {
+        return path.filename();
+    }
+
+    return path.parent_path().filename();
+}
+
+FAT12::Path FAT12::parentPath(const Path& path) {
+    assert(!path.empty());
+
+    // The parent is spelled one way, so its locks and cached slots are the ones every spelling of path resolves to.
+    Path canonical = directoryKey(path);
+    if (canonical == canonical.root_path()) {
+        return "";
+    }
+
+    return canonical.parent_path();
+}
+
+void FAT12::writeSuperblock() {
+    // Write superblock to sector 0.
+    std::array<char, Disk::sectorSize> sector = {};
+    SuperblockLayout::encode(sb, sector);
+    disk.write(0, sector);
+}
+
+void FAT12::readSuperblock() {
+    // Read superblock from sector 0.
+    auto sector = disk.read(0);
+    if (!SuperblockLayout::decode(sector, sb)) {
+        throw CorruptImageException(diskPath);
+    }
+}
+
+void FAT12::writeFat() {
+    ScopedTimer timer("FAT12::writeFat", writeFatCalls, trace);
+    size_t entriesPerBlock = sb.blockSize / sizeof(BlockAddress);
+    std::vector<BlockCache::Block> blocks;
+    std::unique_lock fatLock(fatMutex);
+
+    // Only write the FAT blocks that changed since the last flush.
+    for (BlockAddress blockAddress = fatAddress(); blockAddress < dataAddress(); blockAddress++) {
+        if (!dirtyFatBlocks[blockAddress - fatAddress()]) {
+            continue;
+        }
+
+        // The last FAT block is padded when the FAT does not fill it.
+        BlockCache::Block block = {.address = (size_t)blockAddress, .data = std::vector<char>(sb.blockSize)};
+        size_t begin = (blockAddress - fatAddress()) * entriesPerBlock;
+        size_t end = std::min(begin + entriesPerBlock, fat.size());
+        for (size_t i = begin; i < end; i++) {
+            schema::store(block.data.data() + (i - begin) * sizeof(BlockAddress), fat[i]);
+        }
+        blocks.push_back(std::move(block));
+
+        dirtyFatBlocks[blockAddress - fatAddress()] = false;
+    }
+
+    fatLock.unlock();
+    keepUncommitted(std::move(blocks));
+}
+
+void FAT12::readFat() {
+    fat.resize(sb.blockCount);
+    std::vector<char> buffer((dataAddress() - fatAddress()) * sb.blockSize);
+
+    // FAT is kept in memory, so bypass the block cache and read it with one call.
+    disk.read(blockToSector(fatAddress()), buffer);
+    for (BlockAddress blockAddress = fatAddress(); blockAddress < dataAddress(); blockAddress++) {
+        if (auto block = journaledBlock(blockAddress)) {
+            std::copy(block->begin(), block->end(), buffer.begin() + (blockAddress - fatAddress()) * sb.blockSize);
+        }
+    }
+
+    for (size_t i = 0; i < fat.size(); i++) {
+        fat[i] = schema::load<BlockAddress>(buffer.data() + i * sizeof(BlockAddress));
+    }
+
+    dirtyFatBlocks.assign(dataAddress(), false);
+    buildFreeSpace();
+}
+
+void FAT12::setFat(BlockAddress blockAddress, BlockAddress value) {
+    // The caller holds fatMutex exclusively.
+    fat[blockAddress] = value;
+    dirtyFatBlocks[(blockAddress * sizeof(BlockAddress)) / sb.blockSize] = true;
+
+    if (value == freeBlockMarker()) {
+        freeSpace.markFree(blockAddress);
+    } else {
+        freeSpace.markUsed(blockAddress);
+    }
+}
+
+void FAT12::buildFreeSpace() {
+    freeSpace = FreeSpace(fat.size());
+
+    // Add whole runs, which is much cheaper than adding large images block by block.
+    size_t address = 0;
+    while (address < fat.size()) {
+        size_t end = address;
+        while (end < fat.size() && fat[end] == freeBlockMarker()) {
+            end++;
+        }
+
+        if (end > address) {
+            freeSpace.markRunFree(address, end - address);
+            address = end;
+        } else {
+            address++;
+        }
+    }
+}
+
+void FAT12::writeBlock(BlockAddress blockAddress, const std::vector<char>& block) {
+    ScopedTimer timer("FAT12::writeBlock", writeBlockCalls, trace);
+    assert(blockAddress >= 0 && blockAddress <= maxAddress());
+    assert(block.size() == sb.blockSize);
+
+    // Defer the disk write until flush or eviction.
+    std::lock_guard lock(metadataMutex);
+    std::unique_lock cacheLock(cacheMutex);
+    keepUncommitted(cache.insert(blockAddress, block, true));
+}
+
+template<typename Visit>
+std::invoke_result_t<Visit, const std::vector<char>&> FAT12::visitBlock(BlockAddress blockAddress, Visit visit) {
+    // Counted here rather than in cachedBlock, so hits that return under the shared lock are counted too.
+    ScopedTimer timer("FAT12::readBlock", readBlockCalls, trace);
+    {
+        std::shared_lock cacheLock(cacheMutex);
+        if (auto cached = cache.find(blockAddress)) {
+            return visit(*cached);
+        }
+    }
+
+    std::lock_guard lock(metadataMutex);
+    return visit(cachedBlock(blockAddress));
+}
+
+std::vector<char> FAT12::readBlock(BlockAddress blockAddress) {
+    return visitBlock(blockAddress, [](const std::vector<char>& block) { return block; });
+}
+
+const std::vector<char>& FAT12::cachedBlock(BlockAddress blockAddress) {
+    // A chain shorter than its size ends in the last block marker, which is past every block.
+    if (blockAddress < 0 || blockAddress > maxAddress()) {
+        throw CorruptImageException(diskPath);
+    }
+    std::lock_guard lock(metadataMutex);
+
+    if (auto cached = cache.find(blockAddress)) {
+        return *cached;
+    }
+
+    // The block just inserted is referenced, so it is not evicted to make room for itself.
+    auto block = readBlockFromDisk(blockAddress);
+    std::unique_lock cacheLock(cacheMutex);
+    keepUncommitted(cache.insert(blockAddress, std::move(block), false));
+    return *cache.peek(blockAddress);
+}
+
+void FAT12::writeBlockToDisk(BlockAddress blockAddress, const std::vector<char>& block) {
+    assert(blockAddress >= 0 && blockAddress <= maxAddress());
+    assert(block.size() == sb.blockSize);
+
+    disk.write(blockToSector(blockAddress), block);
+}
+
+std::vector<char> FAT12::readBlockFromDisk(BlockAddress blockAddress) {
+    assert(blockAddress >= 0 && blockAddress <= maxAddress());
+
+    if (auto block = journaledBlock(blockAddress)) {
+        return *block;
+    }
+
+    std::vector<char> block(sb.blockSize);
+    disk.read(blockToSector(blockAddress), block);
+
+    return block;
+}
+
+void FAT12::writeBack(const std::vector<BlockCache::Block>& blocks) {
+    // Blocks are sorted by address, write each contiguous run with one call.
+    for (size_t begin = 0; begin < blocks.size();) {
+        size_t end = begin + 1;
+        while (end < blocks.size() && blocks[end].address == blocks[end - 1].address + 1) {
+            end++;
+        }
+
+        std::vector<std::span<const char>> run;
+        for (size_t i = begin; i < end; i++) {
+            run.push_back(blocks[i].data);
+        }
+        disk.writev(blockToSector(blocks[begin].address), run);
+
+        begin = end;
+    }
+}
+
+std::vector<FreeSpace::Extent> FAT12::allocateBlocks(size_t blockCount, BlockAddress prevAddress) {
+    std::unique_lock fatLock(fatMutex);
+    if (blockCount > freeSpace.freeCount()) {
+        throw NoSpaceException(diskPath);
+    }
+
+    std::vector<FreeSpace::Extent> extents;
+
+    // Continue the run after prevAddress as far as possible so appended blocks stay contiguous.
+    size_t length = 0;
+    while (prevAddress != lastBlockMarker() && length < blockCount && prevAddress + length + 1 <= (size_t)maxAddress() && freeSpace.isFree(prevAddress + length + 1)) {
+        length++;
+    }
+    if (length > 0) {
+        extents.push_back({(size_t)prevAddress + 1, length});
+        prevAddress = linkExtent(extents.back(), prevAddress);
+    }
+
+    // Prefer one contiguous run for the rest, otherwise as few runs as possible.
+    if (length < blockCount) {
+        for (auto& extent : freeSpace.findExtents(blockCount - length)) {
+            extents.push_back(extent);
+            prevAddress = linkExtent(extent, prevAddress);
+        }
+    }
+
+    return extents;
+}
+
+FAT12::BlockAddress FAT12::linkExtent(const FreeSpace::Extent& extent, BlockAddress prevAddress) {
+    // Extents come from free space, so they lie inside the FAT and their ends fit a BlockAddress.
+    auto end = (BlockAddress)(extent.address + extent.length);
+    for (auto address = (BlockAddress)extent.address; address < end; address++) {
+        setFat(address, lastBlockMarker());
+        if (prevAddress != lastBlockMarker()) {
+            setFat(prevAddress, address);
+        }
+        prevAddress = address;
+    }
+
+    return prevAddress;
+}
+
+void FAT12::checkpointReusedBlocks(const std::vector<FreeSpace::Extent>& extents) {
+    std::lock_guard lock(metadataMutex);
+    bool reusesJournaledBlock = std::any_of(extents.begin(), extents.end(), [&](const FreeSpace::Extent& extent) {
+        auto it = checkpointBlocks.lower_bound(extent.address);
+        return it != checkpointBlocks.end() && (size_t)it->first < extent.address + extent.length;
+    });
+    if (reusesJournaledBlock) {
+        checkpoint();
+    }
+}
+
+std::vector<char> FAT12::readBlocks(BlockAddress blockAddress, bool cached) {
+    auto chain = chainAddresses(blockAddress);
+    std::vector<char> buffer(chain.size() * sb.blockSize);
+    readBlocks(chain, buffer, cached);
+
+    return buffer;
+}
+
+void FAT12::readBlocks(const std::vector<BlockAddress>& chain, std::span<char> destination, bool cached) {
+    // A chain shorter than the size it was resolved for ends early in a corrupt image.
+    if (destination.size() > chain.size() * sb.blockSize) {
+        throw CorruptImageException(diskPath);
+    }
+    assert(destination.size() + sb.blockSize > chain.size() * sb.blockSize);
+    assert(!cached || destination.size() == chain.size() * sb.blockSize);
+
+    size_t prefetchEnd = 0;
+    std::unique_lock lock(metadataMutex, std::defer_lock);
+    if (cached) {
+        lock.lock();
+    }
+
+    for (size_t begin = 0; begin < chain.size();) {
+        if (cached) {
+            if (auto block = cache.find(chain[begin])) {
+                std::copy(block->begin(), block->end(), destination.begin() + begin * sb.blockSize);
+                begin++;
+                continue;
+            }
+        }
+
+        // Read the contiguous run of uncached blocks with one call, while the runs after it are fetched.
+        size_t end = begin + 1;
+        while (end < chain.size() && chain[end] == chain[end - 1] + 1 && !(cached && cache.contains(chain[end]))) {
+            end++;
+        }
+        prefetch(chain, end, prefetchEnd);
+
+        // Whole sectors go straight to destination. When it ends inside a sector, that sector is read into tail.
+        size_t runBegin = begin * sb.blockSize;
+        size_t runEnd = std::min(end * sb.blockSize, destination.size());
+        size_t directEnd = runBegin + (runEnd - runBegin) / Disk::sectorSize * Disk::sectorSize;
+        std::array<char, Disk::sectorSize> tail;
+        std::vector<std::span<char>> buffers;
+        if (directEnd > runBegin) {
+            buffers.push_back(destination.subspan(runBegin, directEnd - runBegin));
+        }
+        if (directEnd < runEnd) {
+            buffers.push_back(tail);
+        }
+        disk.readv(blockToSector(chain[begin]), buffers);
+        std::copy(tail.begin(), tail.begin() + (runEnd - directEnd), destination.begin() + directEnd);
+
+        for (size_t i = begin; cached && i < end; i++) {
+            auto block = destination.begin() + i * sb.blockSize;
+            if (auto journaled = journaledBlock(chain[i])) {
+                std::copy(journaled->begin(), journaled->end(), block);
+            }
+            std::unique_lock cacheLock(cacheMutex);
+            keepUncommitted(cache.insert(chain[i], std::vector<char>(block, block + sb.blockSize), false));
+        }
+
+        begin = end;
+    }
+}
+
+void FAT12::prefetch(const std::vector<BlockAddress>& chain, size_t begin, size_t& prefetchEnd) {
+    size_t end = std::min(chain.size(), begin + readAheadSize / sb.blockSize);
+
+    for (size_t i = std::max(begin, prefetchEnd); i < end;) {
+        size_t runEnd = i + 1;
+        while (runEnd < end && chain[runEnd] == chain[runEnd - 1] + 1) {
+            runEnd++;
+        }
+        disk.advise(blockToSector(chain[i]), (runEnd - i) * (sb.blockSize / Disk::sectorSize));
+        i = runEnd;
+    }
+
+    prefetchEnd = std::max(prefetchEnd, end);
+}
+
+void FAT12::prefetch(OpenFile& file, size_t blockIndex) {
+    // The block at blockIndex is read right away.
+    size_t begin = std::max(blockIndex + 1, file.prefetchEnd);
+    size_t end = std::min(blockCount(file.size), blockIndex + readAheadSize / sb.blockSize);
+    if (begin >= end) {
+        return;
+    }
+
+    // Walk from the cursor without moving it, so that the next seek stays sequential.
+    std::vector<BlockAddress> chain;
+    {
+        std::shared_lock fatLock(fatMutex);
+        size_t index = file.cursorIndex <= begin ? file.cursorIndex : 0;
+        BlockAddress address = file.cursorIndex <= begin ? file.cursorAddress : file.firstBlockAddress;
+        for (; index < end; index++, address = fat[address]) {
+            checkChainAddress(address);
+            if (index >= begin) {
+                chain.push_back(address);
+            }
+        }
+    }
+
+    size_t chainEnd = 0;
+    prefetch(chain, 0, chainEnd);
+    file.prefetchEnd = end;
+}
+
+void FAT12::writeExtent(BlockAddress blockAddress, std::span<const char> data) {
+    // Write whole blocks straight from data and pad the last partial block with zeros.
+    size_t wholeSize = data.size() / sb.blockSize * sb.blockSize;
+    std::vector<char> tail(data.begin() + wholeSize, data.end());
+    tail.resize(tail.empty() ? 0 : sb.blockSize);
+
+    std::vector<std::span<const char>> buffers;
+    if (wholeSize > 0) {
+        buffers.push_back(data.first(wholeSize));
+    }
+    if (!tail.empty()) {
+        buffers.push_back(tail);
+    }
+    disk.writev(blockToSector(blockAddress), buffers);
+}
+
+void FAT12::createFile(const Path& path) {
+    checkPermission(parentPath(path), "w");
+
+    // Add new file's directory entry to its parent directory.
+    auto now = getNow();
+    DirectoryEntry entry = {
+        .attributes = {
+            .isDirectory = false,
+            .name = pathToName(path),
+            .created = now,
+            .lastModified = now
+        }
+    };
+    addDirectoryEntry(path, entry);
+}
+
+void FAT12::resize(OpenFile& file, size_t size) {
+    if (size > std::numeric_limits<FileSize>::max()) {
+        throw FileTooLargeException(file.path);
+    }
+
+    size_t oldBlockCount = blockCount(file.size);
+    size_t newBlockCount = blockCount(size);
+
+    if (newBlockCount < oldBlockCount) {
+        // Cut the chain after its new last block.
+        if (newBlockCount == 0) {
+            freeBlocks(file.firstBlockAddress);
+            file.firstBlockAddress = lastBlockMarker();
+        } else {
+            BlockAddress lastAddress = seek(file, newBlockCount - 1);
+            BlockAddress nextAddress;
+            {
+                std::unique_lock fatLock(fatMutex);
+                nextAddress = fat[lastAddress];
+                setFat(lastAddress, lastBlockMarker());
+            }
+            freeBlocks(nextAddress);
+        }
+    } else if (newBlockCount > oldBlockCount) {
+        // Grow the chain at its tail.
+        BlockAddress lastAddress = oldBlockCount > 0 ? seek(file, oldBlockCount - 1) : lastBlockMarker();
+        auto extents = allocateBlocks(newBlockCount - oldBlockCount, lastAddress);
+        if (lastAddress == lastBlockMarker()) {
+            file.firstBlockAddress = extents.front().address;
+        }
+
+        checkpointReusedBlocks(extents);
+    }
+
+    // The cursor may be in the part that was cut.
+    if (newBlockCount == 0 || oldBlockCount == 0 || file.cursorIndex >= newBlockCount) {
+        file.cursorIndex = 0;
+        file.cursorAddress = file.firstBlockAddress;
+    }
+
+    file.size = size;
+    file.modified = true;
+}
+
+void FAT12::writeChangedBlocks(BlockAddress blockAddress, size_t blockIndex, size_t blockCount, size_t oldSize, std::span<const char> data) {
+    std::vector<char> run(blockCount * sb.blockSize);
+    disk.read(blockToSector(blockAddress), run);
+
+    for (size_t i = 0; i < blockCount;) {
+        if (!blockChanged(run, i, blockIndex + i, oldSize, data)) {
+            i++;
+            continue;
+        }
+
+        // Write the contiguous changed blocks with one call.
+        size_t end = i + 1;
+        while (end < blockCount && blockChanged(run, end, blockIndex + end, oldSize, data)) {
+            end++;
+        }
+
+        size_t begin = (blockIndex + i) * sb.blockSize;
+        size_t length = std::min((end - i) * sb.blockSize, data.size() - begin);
+        writeExtent(blockAddress + i, data.subspan(begin, length));
+        i = end;
+    }
+}
+
+bool FAT12::blockChanged(const std::vector<char>& run, size_t runIndex, size_t blockIndex, size_t oldSize, std::span<const char> data) {
+    size_t begin = blockIndex * sb.blockSize;
+    size_t newEnd = std::min(begin + sb.blockSize, data.size());
+    size_t oldEnd = std::min(begin + sb.blockSize, oldSize);
+
+    // Bytes past the new end of file do not matter, bytes past the old end of file are unknown.
+    if (newEnd > oldEnd) {
+        return true;
+    }
+    return !std::equal(data.begin() + begin, data.begin() + newEnd, run.begin() + runIndex * sb.blockSize);
+}
+
+FAT12::OpenFile& FAT12::openFile(FileHandle handle) {
+    std::lock_guard lock(openFilesMutex);
+    auto it = openFiles.find(handle);
+    assert(it != openFiles.end());
+    return it->second;
+}
+
+bool FAT12::isOpen(const Path& path, bool below) {
+    std::lock_guard lock(openFilesMutex);
+    return std::any_of(openFiles.begin(), openFiles.end(), [&](const auto& file) {
+        if (!below) {
+            return file.second.path == path;
+        }
+        auto [end, _] = std::mismatch(path.begin(), path.end(), file.second.path.begin(), file.second.path.end());
+        return end == path.end();
+    });
+}
+
+FAT12::BlockAddress FAT12::seek(OpenFile& file, size_t blockIndex) {
+    assert(blockIndex < blockCount(file.size));
+
+    if (blockIndex < file.cursorIndex) {
+        file.cursorIndex = 0;
+        file.cursorAddress = file.firstBlockAddress;
+    }
+
+    std::shared_lock fatLock(fatMutex);
+    for (; file.cursorIndex < blockIndex; file.cursorIndex++) {
+        checkChainAddress(file.cursorAddress);
+        file.cursorAddress = fat[file.cursorAddress];
+    }
+
+    checkChainAddress(file.cursorAddress);
+    return file.cursorAddress;
+}
+
+template<typename Transfer>
+void FAT12::forEachRun(OpenFile& file, size_t offset, size_t length, Transfer transfer) {
+    if (length == 0) {
+        return;
+    }
+
+    size_t lastIndex = (offset + length - 1) / sb.blockSize;
+    size_t index = offset / sb.blockSize;
+    BlockAddress address = seek(file, index);
+
+    while (index <= lastIndex) {
+        // Extend the run while the chain stays contiguous.
+        // Runs are part of one chain inside the FAT, so their lengths fit a BlockAddress.
+        BlockAddress count = 1;
+        std::shared_lock fatLock(fatMutex);
+        while (index + count <= lastIndex && fat[address + count - 1] == address + count) {
+            count++;
+        }
+        fatLock.unlock();
+        assert(address >= dataAddress() && address + count - 1 <= maxAddress());
+
+        transfer(index, address, count);
+
+        index += count;
+        if (index <= lastIndex) {
+            address = seek(file, index);
         }
+    }
+}
 
-        if (updated) {
-            writeDirectoryEntry(path, entry);
+std::vector<FAT12::BlockAddress> FAT12::chainAddresses(BlockAddress blockAddress, size_t blockCount) {
+    std::vector<BlockAddress> chain;
+    std::shared_lock fatLock(fatMutex);
+
+    // A chain longer than the FAT runs in a loop.
+    for (; blockAddress != lastBlockMarker() && chain.size() < blockCount; blockAddress = fat[blockAddress]) {
+        checkChainAddress(blockAddress);
+        if (chain.size() == fat.size()) {
+            throw CorruptImageException(diskPath);
         }
+        chain.push_back(blockAddress);
     }
 
-    return buffer.size();
+    return chain;
 }
 
-std::vector<FAT12::DirectoryEntry> FAT12::readDirectory(const Path& path) {
-    checkIsDirectory(path, true);
-    auto [address, size] = pathToAddressAndSize(path);
-    return readDirectory(address, size);
+void FAT12::checkChainAddress(BlockAddress blockAddress) const {
+    if (blockAddress < dataAddress() || blockAddress > maxAddress()) {
+        throw CorruptImageException(diskPath);
+    }
+}
+
+std::vector<FreeSpace::Extent> FAT12::chainExtents(BlockAddress blockAddress, size_t blockCount) {
+    std::vector<FreeSpace::Extent> extents;
+    std::shared_lock fatLock(fatMutex);
+
+    for (size_t length = 0; blockAddress != lastBlockMarker() && blockCount > 0; blockAddress = fat[blockAddress], blockCount--, length++) {
+        checkChainAddress(blockAddress);
+        if (length == fat.size()) {
+            throw CorruptImageException(diskPath);
+        }
+        if (!extents.empty() && extents.back().address + extents.back().length == (size_t)blockAddress) {
+            extents.back().length++;
+        } else {
+            extents.push_back({(size_t)blockAddress, 1});
+        }
+    }
+
+    return extents;
+}
+
+void FAT12::freeBlocks(const Path& path) {
+    auto [address, _] = pathToAddressAndSize(path);
+    freeBlocks(address);
+}
+
+void FAT12::freeBlocks(BlockAddress blockAddress) {
+    assert((blockAddress >= dataAddress() && blockAddress <= maxAddress()) || blockAddress == lastBlockMarker());
+    std::lock_guard lock(metadataMutex);
+    std::unique_lock fatLock(fatMutex);
+
+    while (blockAddress != lastBlockMarker()) {
+        BlockAddress nextAddress = fat[blockAddress];
+        setFat(blockAddress, freeBlockMarker());
+
+        // A freed block may be reused for file data, which bypasses the cache and the journal.
+        std::unique_lock cacheLock(cacheMutex);
+        cache.discard(blockAddress);
+        uncommittedBlocks.erase(blockAddress);
+        blockAddress = nextAddress;
+    }
+}
+
+void FAT12::addDirectoryEntry(const Path& path, const DirectoryEntry& entry) {
+    Path parent = parentPath(path);
+    const std::string& name = entry.attributes.name;
+    checkIsDirectory(parent, true);
+    std::lock_guard lock(metadataMutex);
+
+    if (name.size() > maxNameLength) {
+        throw NameTooLongException(path);
+    }
+
+    auto directory = readDirectoryEntry(parent);
+    if (findEntry(parent, directory, name)) {
+        throw FileExistsException(path);
+    }
+
+    // Reuse the most recently freed slot, otherwise append one and grow the chain by a zeroed block when the last one is full.
+    size_t slot = directory.attributes.size / directoryEntrySize;
+    bool appendsSlot = directory.freeSlotHead == 0;
+    if (!appendsSlot) {
+        slot = directory.freeSlotHead - 1;
+        if (readDirectorySlot(directory.firstBlockAddress, slot, &directory.freeSlotHead)) {
+            throw CorruptImageException(diskPath);
+        }
+    }
+    bool growsChain = appendsSlot && slot % entriesPerBlock() == 0;
+
+    // Directories get a name index once they outgrow one block, and a new one once it gets too full.
+    bool rebuildsIndex = false;
+    size_t entryCount = 0;
+    if (directory.indexBlockAddress != lastBlockMarker()) {
+        auto header = readIndexHeader(directory.indexBlockAddress);
+        rebuildsIndex = (header.usedBucketCount + 1) * 2 > header.bucketCount;
+        entryCount = header.entryCount + 1;
+    } else if (slot >= entriesPerBlock()) {
+        rebuildsIndex = true;
+        entryCount = cachedDirectory(parent, directory.firstBlockAddress, directory.attributes.size).index.size() + 1;
+    }
+
+    // Allocate every block the entry needs before anything is written, so a full file system leaves the directory as it was.
+    std::vector<FreeSpace::Extent> indexExtents;
+    if (rebuildsIndex) {
+        indexExtents = allocateBlocks(indexBlockCount(entryCount), lastBlockMarker());
+    }
+    if (growsChain) {
+        BlockAddress newAddress;
+        try {
+            BlockAddress lastAddress = slot > 0 ? chainAddress(directory.firstBlockAddress, slot / entriesPerBlock() - 1) : lastBlockMarker();
+            newAddress = allocateBlocks(1, lastAddress).front().address;
+        } catch (...) {
+            if (!indexExtents.empty()) {
+                freeBlocks(indexExtents.front().address);
+            }
+            throw;
+        }
+
+        writeBlock(newAddress, std::vector<char>(sb.blockSize));
+        if (slot == 0) {
+            directory.firstBlockAddress = newAddress;
+        }
+    }
+    if (appendsSlot) {
+        directory.attributes.size += directoryEntrySize;
+    }
+
+    writeDirectory(directory.firstBlockAddress, slot, entry);
+
+    {
+        std::unique_lock cacheLock(cacheMutex);
+        auto cached = directoryCache.find(directoryKey(parent));
+        if (cached != directoryCache.end()) {
+            auto& slots = cached->second.slots;
+            slots.resize(std::max(slots.size(), slot + 1));
+            slots[slot] = entry;
+            cached->second.index[name] = slot;
+        }
+    }
+
+    if (rebuildsIndex) {
+        buildIndex(parent, directory, std::move(indexExtents));
+    } else if (directory.indexBlockAddress != lastBlockMarker()) {
+        insertIndex(parent, directory, name, slot);
+    }
+
+    touchDirectory(parent, directory);
+}
+
+void FAT12::removeDirectoryEntry(const Path& path) {
+    std::lock_guard lock(metadataMutex);
+    Path parent = parentPath(path);
+    std::string name = pathToName(path);
+
+    auto directory = readDirectoryEntry(parent);
+    auto found = findEntry(parent, directory, name);
+    if (!found) {
+        throw NoSuchFileOrDirectoryException(path);
+    }
+
+    auto& [slot, entry] = *found;
+    if (entry.attributes.isDirectory) {
+        eraseDirectoryCache(path);
+    }
+
+    // The slot stays in place and joins the free list, so no other entry moves.
+    checkSlotName(directory, slot, name);
+    writeDirectory(directory.firstBlockAddress, slot, std::nullopt, directory.freeSlotHead);
+    directory.freeSlotHead = slot + 1;
+
+    {
+        std::unique_lock cacheLock(cacheMutex);
+        auto cached = directoryCache.find(directoryKey(parent));
+        if (cached != directoryCache.end()) {
+            cached->second.slots[slot].reset();
+            cached->second.index.erase(name);
+        }
+    }
+
+    if (directory.indexBlockAddress != lastBlockMarker()) {
+        removeIndex(directory, name, slot);
+    }
+
+    touchDirectory(parent, directory);
 }
 
-std::pair<FAT12::BlockAddress, FAT12::BlockAddress> FAT12::pathToAddressAndSize(const Path& path) {
-    // Start with the address and size of the directory that contains root directory entry.
-    auto address = dataAddress();
-    auto size = sb.rootDirectoryEntrySize;
+void FAT12::writeDirectoryEntry(const Path& path, const DirectoryEntry& directoryEntry) {
+    std::lock_guard lock(metadataMutex);
+    Path parent = parentPath(path);
+    std::string name = pathToName(path);
+
+    auto directory = readDirectoryEntry(parent);
+    auto found = findEntry(parent, directory, name);
+    if (!found) {
+        throw NoSuchFileOrDirectoryException(path);
+    }
+
+    size_t slot = found->first;
+    const std::string& newName = directoryEntry.attributes.name;
+    bool renamed = newName != name;
+
+    if (renamed) {
+        if (newName.size() > maxNameLength) {
+            throw NameTooLongException(parent/newName);
+        }
+        if (findEntry(parent, directory, newName)) {
+            throw FileExistsException(parent/newName);
+        }
+
+        // Cached subdirectories are keyed by the old path.
+        if (found->second.attributes.isDirectory) {
+            eraseDirectoryCache(path);
+        }
+    }
+
+    checkSlotName(directory, slot, name);
+    writeDirectory(directory.firstBlockAddress, slot, directoryEntry);
+
+    {
+        std::unique_lock cacheLock(cacheMutex);
+        auto cached = directoryCache.find(directoryKey(parent));
+        if (cached != directoryCache.end()) {
+            cached->second.slots[slot] = directoryEntry;
+            if (renamed) {
+                cached->second.index.erase(name);
+                cached->second.index[newName] = slot;
+            }
+        }
+    }
+
+    if (renamed) {
+        if (directory.indexBlockAddress != lastBlockMarker()) {
+            removeIndex(directory, name, slot);
+            insertIndex(parent, directory, newName, slot);
+        }
+        touchDirectory(parent, directory);
+    }
+}
 
-    // If this is the directory that contains root directory entry, return with the initial address and size.
+void FAT12::touchDirectory(const Path& path, DirectoryEntry& directory) {
+    // The directory that contains root directory entry has no entry of its own.
     if (path.empty()) {
-        return {address, size};
+        return;
     }
 
-    auto directory = readDirectory(address, size);
-    bool fileFound = false;
+    directory.attributes.lastModified = getNow();
+    writeDirectoryEntry(path, directory);
+}
+
+FAT12::DirectoryEntry FAT12::readDirectoryEntry(const Path& path) {
+    // Start with the directory that contains root directory entry, which has no entry of its own.
+    DirectoryEntry entry = {
+        .attributes = {.isDirectory = true, .size = sb.rootDirectoryEntrySize},
+        .firstBlockAddress = dataAddress()
+    };
     Path currPath = "";
 
     for (auto& name : path) {
-        bool found = false;
-
-        if (fileFound) {
+        if (!entry.attributes.isDirectory) {
             throw NotADirectoryException(currPath);
         }
 
-        currPath = currPath/name;
+        auto found = findEntry(currPath, entry, name.native());
+        currPath /= name;
 
-        for (auto& entry : directory) {
-            if (entry.attributes.name == name) {
-                found = true;
-                address = entry.firstBlockAddress;
-                size = entry.attributes.size;
+        if (!found) {
+            throw NoSuchFileOrDirectoryException(currPath);
+        }
 
-                if (entry.attributes.isDirectory) {
-                    directory = readDirectory(address, size);
-                } else {
-                    fileFound = true;
-                }
+        entry = std::move(found->second);
+    }
 
-                break;
+    return entry;
+}
+
+std::optional<std::pair<size_t, FAT12::DirectoryEntry>> FAT12::findEntry(const Path& path, const DirectoryEntry& directory, std::string_view name) {
+    {
+        std::shared_lock cacheLock(cacheMutex);
+        if (auto cached = directoryCache.find(directoryKey(path)); cached != directoryCache.end()) {
+            cached->second.referenced.store(true, std::memory_order_relaxed);
+            auto it = cached->second.index.find(name);
+            if (it == cached->second.index.end()) {
+                return std::nullopt;
             }
+
+            return std::pair{it->second, *cached->second.slots[it->second]};
         }
+    }
 
-        if (!found) {
-            throw NoSuchFileOrDirectoryException(currPath);
+    // Directories that are not cached are not loaded for a lookup. Large ones are looked up through their index,
+    // and the others, which fit in one block, are scanned in place until the name turns up.
+    if (directory.indexBlockAddress != lastBlockMarker()) {
+        return lookupIndex(directory, name);
+    }
+
+    size_t slotCount = directory.attributes.size / directoryEntrySize;
+    BlockAddress blockAddress = directory.firstBlockAddress;
+    for (size_t slot = 0; slot < slotCount; slot += entriesPerBlock(), blockAddress = chainAddress(blockAddress, 1)) {
+        size_t blockSlotCount = std::min(entriesPerBlock(), slotCount - slot);
+        auto found = visitBlock(blockAddress, [&](const std::vector<char>& block) -> std::optional<std::pair<size_t, DirectoryEntry>> {
+            auto slots = std::span<const char>(block).first(blockSlotCount * directoryEntrySize);
+            if (auto match = DirectoryView(*this, slots, slot).find(name)) {
+                return std::pair{match->slot, *deserializeEntry(match->bytes)};
+            }
+            return std::nullopt;
+        });
+        if (found) {
+            return found;
+        }
+    }
+
+    return std::nullopt;
+}
+
+void FAT12::writeDirectory(BlockAddress blockAddress, size_t slot, const std::optional<DirectoryEntry>& entry, uint32_t nextFreeSlot) {
+    ScopedTimer timer("FAT12::writeDirectory", writeDirectoryCalls, trace);
+
+    // Slots never cross block boundaries, so patching one is a read-modify-write of a single block. Entries of
+    // sibling directories share blocks of their parent and are patched concurrently.
+    std::lock_guard lock(metadataMutex);
+    blockAddress = chainAddress(blockAddress, slot / entriesPerBlock());
+    auto block = readBlock(blockAddress);
+    serializeEntry(std::span<char>(block).subspan(slot % entriesPerBlock() * directoryEntrySize, directoryEntrySize), entry, nextFreeSlot);
+    writeBlock(blockAddress, block);
+}
+
+std::optional<FAT12::DirectoryEntry> FAT12::readDirectorySlot(BlockAddress blockAddress, size_t slot, uint32_t* nextFreeSlot) {
+    return visitBlock(chainAddress(blockAddress, slot / entriesPerBlock()), [&](const std::vector<char>& block) {
+        return deserializeEntry(std::span<const char>(block).subspan(slot % entriesPerBlock() * directoryEntrySize, directoryEntrySize), nextFreeSlot);
+    });
+}
+
+void FAT12::checkSlotName(const DirectoryEntry& directory, size_t slot, std::string_view name) {
+    auto entry = readDirectorySlot(directory.firstBlockAddress, slot);
+    if (!entry || entry->attributes.name != name) {
+        throw CorruptImageException(diskPath);
+    }
+}
+
+std::vector<FAT12::DirectoryEntry> FAT12::readDirectory(const Path& path) {
+    ScopedTimer timer("FAT12::readDirectory", readDirectoryCalls, trace);
+    checkIsDirectory(path, true);
+    auto [address, size] = pathToAddressAndSize(path);
+
+    auto copyEntries = [](const CachedDirectory& directory) {
+        std::vector<DirectoryEntry> entries;
+        for (auto& slot : directory.slots) {
+            if (slot) {
+                entries.push_back(*slot);
+            }
+        }
+        return entries;
+    };
+
+    {
+        std::shared_lock cacheLock(cacheMutex);
+        if (auto cached = directoryCache.find(directoryKey(path)); cached != directoryCache.end()) {
+            cached->second.referenced.store(true, std::memory_order_relaxed);
+            return copyEntries(cached->second);
         }
     }
 
-    return {address, size};
+    std::lock_guard lock(metadataMutex);
+    return copyEntries(cachedDirectory(path, address, size));
+}
+
+std::pair<FAT12::BlockAddress, FAT12::FileSize> FAT12::pathToAddressAndSize(const Path& path) {
+    ScopedTimer timer("FAT12::pathToAddressAndSize", pathToAddressAndSizeCalls, trace);
+    auto entry = readDirectoryEntry(path);
+    return {entry.firstBlockAddress, entry.attributes.size};
 }
 
-std::vector<FAT12::DirectoryEntry> FAT12::readDirectory(BlockAddress blockAddress, BlockAddress size) {
-    std::vector<DirectoryEntry> directory;
+std::vector<std::optional<FAT12::DirectoryEntry>> FAT12::readDirectory(BlockAddress blockAddress, FileSize size) {
+    std::vector<std::optional<DirectoryEntry>> slots(size / directoryEntrySize);
     auto buffer = readBlocks(blockAddress);
+    if (size > buffer.size()) {
+        throw CorruptImageException(diskPath);
+    }
+
+    for (auto entry : DirectoryView(*this, std::span<const char>(buffer).first(size))) {
+        slots[entry.slot] = deserializeEntry(entry.bytes);
+    }
+
+    return slots;
+}
+
+FAT12::BlockAddress FAT12::chainAddress(BlockAddress blockAddress, size_t blockIndex) const {
+    std::shared_lock fatLock(fatMutex);
+    for (size_t i = 0; i < blockIndex; i++) {
+        checkChainAddress(blockAddress);
+        blockAddress = fat[blockAddress];
+    }
+
+    return blockAddress;
+}
+
+void FAT12::serializeEntry(std::span<char> slot, const std::optional<DirectoryEntry>& entry, uint32_t nextFreeSlot) const {
+    std::fill(slot.begin(), slot.end(), 0);
+    if (entry) {
+        EntryLayout::encode(*entry, slot);
+    } else {
+        FreeSlotLayout::encode(FreeSlot{nextFreeSlot}, slot);
+    }
+}
+
+std::optional<FAT12::DirectoryEntry> FAT12::deserializeEntry(std::span<const char> slot, uint32_t* nextFreeSlot) const {
+    FreeSlot freeSlot;
+    if (FreeSlotLayout::decode(slot, freeSlot)) {
+        if (nextFreeSlot) {
+            *nextFreeSlot = freeSlot.nextFreeSlot;
+        }
+        return std::nullopt;
+    }
+
+    DirectoryEntry entry;
+    if (!EntryLayout::decode(slot, entry)) {
+        throw CorruptImageException(diskPath);
+    }
+
+    return entry;
+}
+
+FAT12::DirectoryView::Entry FAT12::DirectoryView::Iterator::operator*() const {
+    auto bytes = view->slot(index);
+    auto name = NameField::view(bytes.data() + nameOffset);
+    if (!name) {
+        throw CorruptImageException(view->fs.diskPath);
+    }
+
+    return {view->firstSlot + index, *name, bytes};
+}
+
+void FAT12::DirectoryView::Iterator::skipUnused() {
+    for (size_t count = view->slots.size() / directoryEntrySize; index < count; index++) {
+        auto used = schema::load<uint8_t>(view->slot(index).data());
+        if (used == usedSlot) {
+            return;
+        }
+        if (used != unusedSlot) {
+            throw CorruptImageException(view->fs.diskPath);
+        }
+    }
+}
+
+std::optional<FAT12::DirectoryView::Entry> FAT12::DirectoryView::find(std::string_view name) const {
+    for (auto entry : *this) {
+        if (entry.name == name) {
+            return entry;
+        }
+    }
+
+    return std::nullopt;
+}
+
+uint32_t FAT12::nameHash(std::string_view name) {
+    // FNV-1a, which unlike std::hash is the same on every platform.
+    uint32_t hash = 2166136261u;
+    for (unsigned char c : name) {
+        hash ^= c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+FAT12::IndexHeader FAT12::readIndexHeader(BlockAddress indexAddress) {
+    IndexHeader header;
+
+    // Probing masks bucket numbers with bucketCount - 1.
+    bool decoded = visitBlock(indexAddress, [&](const std::vector<char>& block) { return IndexHeaderLayout::decode(block, header); });
+    if (!decoded || header.bucketCount == 0 || (header.bucketCount & (header.bucketCount - 1)) != 0) {
+        throw CorruptImageException(diskPath);
+    }
+
+    return header;
+}
+
+void FAT12::writeIndexHeader(BlockAddress indexAddress, const IndexHeader& header) {
+    auto block = readBlock(indexAddress);
+    IndexHeaderLayout::encode(header, block);
+    writeBlock(indexAddress, block);
+}
+
+FAT12::IndexBucket FAT12::readIndexBucket(BlockAddress indexAddress, uint32_t bucket) {
+    size_t position = indexHeaderSize + (size_t)bucket * indexBucketSize;
+    IndexBucket result;
+    bool decoded = visitBlock(chainAddress(indexAddress, position / sb.blockSize), [&](const std::vector<char>& block) {
+        return IndexBucketLayout::decode(std::span<const char>(block).subspan(position % sb.blockSize), result);
+    });
+    if (!decoded) {
+        throw CorruptImageException(diskPath);
+    }
+
+    return result;
+}
+
+void FAT12::writeIndexBucket(BlockAddress indexAddress, uint32_t bucket, const IndexBucket& value) {
+    size_t position = indexHeaderSize + (size_t)bucket * indexBucketSize;
+    BlockAddress blockAddress = chainAddress(indexAddress, position / sb.blockSize);
+
+    auto block = readBlock(blockAddress);
+    IndexBucketLayout::encode(value, std::span<char>(block).subspan(position % sb.blockSize));
+    writeBlock(blockAddress, block);
+}
+
+std::optional<std::pair<size_t, FAT12::DirectoryEntry>> FAT12::lookupIndex(const DirectoryEntry& directory, std::string_view name) {
+    auto header = readIndexHeader(directory.indexBlockAddress);
+    uint32_t hash = nameHash(name);
+    uint32_t mask = header.bucketCount - 1;
+
+    // Probe until an empty bucket. Matching hashes are confirmed against the name in the slot.
+    uint32_t bucket = hash & mask;
+    for (uint32_t i = 0; i < header.bucketCount; i++, bucket = (bucket + 1) & mask) {
+        auto value = readIndexBucket(directory.indexBlockAddress, bucket);
+        if (value.slot == emptyBucket) {
+            break;
+        }
+
+        if (value.slot != deletedBucket && value.hash == hash) {
+            size_t slot = value.slot - firstSlotBucket;
+            if (slot >= directory.attributes.size / directoryEntrySize) {
+                throw CorruptImageException(diskPath);
+            }
+            // Only the matching entry is decoded.
+            auto found = visitBlock(chainAddress(directory.firstBlockAddress, slot / entriesPerBlock()), [&](const std::vector<char>& block) {
+                auto bytes = std::span<const char>(block).subspan(slot % entriesPerBlock() * directoryEntrySize, directoryEntrySize);
+                auto match = DirectoryView(*this, bytes, slot).find(name);
+                return match ? deserializeEntry(match->bytes) : std::nullopt;
+            });
+            if (found) {
+                return std::pair{slot, *found};
+            }
+        }
+    }
+
+    return std::nullopt;
+}
+
+void FAT12::insertIndex(const Path& path, DirectoryEntry& directory, const std::string& name, size_t slot) {
+    auto header = readIndexHeader(directory.indexBlockAddress);
+
+    // Keep at most half of the buckets used, deleted ones included, so probe sequences stay short.
+    // The entry is already in its slot, so a rebuilt index includes it.
+    if ((header.usedBucketCount + 1) * 2 > header.bucketCount) {
+        buildIndex(path, directory);
+        return;
+    }
+
+    uint32_t hash = nameHash(name);
+    uint32_t mask = header.bucketCount - 1;
+
+    for (uint32_t bucket = hash & mask;; bucket = (bucket + 1) & mask) {
+        auto value = readIndexBucket(directory.indexBlockAddress, bucket);
+        if (value.slot == emptyBucket || value.slot == deletedBucket) {
+            writeIndexBucket(directory.indexBlockAddress, bucket, {hash, (uint32_t)slot + firstSlotBucket});
+            if (value.slot == emptyBucket) {
+                header.usedBucketCount++;
+            }
+            header.entryCount++;
+            writeIndexHeader(directory.indexBlockAddress, header);
+            return;
+        }
+    }
+}
+
+void FAT12::removeIndex(const DirectoryEntry& directory, const std::string& name, size_t slot) {
+    auto header = readIndexHeader(directory.indexBlockAddress);
+    uint32_t hash = nameHash(name);
+    uint32_t mask = header.bucketCount - 1;
+
+    uint32_t bucket = hash & mask;
+    for (uint32_t i = 0; i < header.bucketCount; i++, bucket = (bucket + 1) & mask) {
+        auto value = readIndexBucket(directory.indexBlockAddress, bucket);
+        if (value.slot == emptyBucket) {
+            break;
+        }
+
+        // Deleted buckets keep probe sequences that pass through them intact.
+        if (value.slot == slot + firstSlotBucket) {
+            writeIndexBucket(directory.indexBlockAddress, bucket, {0, deletedBucket});
+            header.entryCount--;
+            writeIndexHeader(directory.indexBlockAddress, header);
+            return;
+        }
+    }
+
+    // The index of a consistent directory holds every name in it.
+    throw CorruptImageException(diskPath);
+}
+
+void FAT12::buildIndex(const Path& path, DirectoryEntry& directory, std::vector<FreeSpace::Extent> extents) {
+    auto& cached = cachedDirectory(path, directory.firstBlockAddress, directory.attributes.size);
+
+    // Start at most a quarter full, so the next rebuild comes after the directory has doubled.
+    IndexHeader header = {
+        .bucketCount = indexBucketCount(cached.index.size()),
+        .usedBucketCount = (uint32_t)cached.index.size(),
+        .entryCount = (uint32_t)cached.index.size()
+    };
+
+    // The whole index is encoded into one buffer and written block by block.
+    std::vector<char> buffer(indexBlockCount(header.entryCount) * sb.blockSize);
+    IndexHeaderLayout::encode(header, buffer);
+    auto bucketSpan = [&](uint32_t bucket) {
+        return std::span<char>(buffer).subspan(indexHeaderSize + (size_t)bucket * indexBucketSize, indexBucketSize);
+    };
+
+    uint32_t mask = header.bucketCount - 1;
+    for (auto& [name, slot] : cached.index) {
+        uint32_t hash = nameHash(name);
+        uint32_t bucket = hash & mask;
+        IndexBucket value;
+        while (IndexBucketLayout::decode(bucketSpan(bucket), value), value.slot != emptyBucket) {
+            bucket = (bucket + 1) & mask;
+        }
+
+        IndexBucketLayout::encode(IndexBucket{hash, (uint32_t)slot + firstSlotBucket}, bucketSpan(bucket));
+    }
+
+    // Allocate the new index before freeing the old one, so a failed allocation leaves the old one intact.
+    if (extents.empty()) {
+        extents = allocateBlocks(buffer.size() / sb.blockSize, lastBlockMarker());
+    }
+    assert(std::accumulate(extents.begin(), extents.end(), (size_t)0, [](size_t sum, const FreeSpace::Extent& extent) {
+        return sum + extent.length;
+    }) == buffer.size() / sb.blockSize);
+    freeBlocks(directory.indexBlockAddress);
+    directory.indexBlockAddress = extents.front().address;
+
     size_t offset = 0;
+    for (auto& extent : extents) {
+        for (size_t i = 0; i < extent.length; i++, offset += sb.blockSize) {
+            writeBlock(extent.address + i, std::vector<char>(buffer.begin() + offset, buffer.begin() + offset + sb.blockSize));
+        }
+    }
+}
 
-    while (offset < size) {
-        DirectoryEntry entry;
+uint32_t FAT12::indexBucketCount(size_t entryCount) const {
+    auto bucketCount = (uint32_t)(sb.blockSize / (2 * indexBucketSize));
+    while (bucketCount < entryCount * 4) {
+        bucketCount *= 2;
+    }
+    return bucketCount;
+}
+
+size_t FAT12::indexBlockCount(size_t entryCount) const {
+    return blockCount(indexHeaderSize + (size_t)indexBucketCount(entryCount) * indexBucketSize);
+}
+
+FAT12::CachedDirectory& FAT12::cachedDirectory(const Path& path, BlockAddress blockAddress, FileSize size) {
+    std::string key = directoryKey(path);
+    auto it = directoryCache.find(key);
+    if (it != directoryCache.end()) {
+        it->second.referenced = true;
+        return it->second;
+    }
 
-        deserialize(buffer, offset, entry.attributes.isDirectory);
-        deserialize(buffer, offset, entry.attributes.name);
-        deserialize(buffer, offset, entry.attributes.size);
-        deserialize(buffer, offset, entry.attributes.canRead);
-        deserialize(buffer, offset, entry.attributes.canWrite);
-        deserialize(buffer, offset, entry.attributes.created);
-        deserialize(buffer, offset, entry.attributes.lastModified);
-        deserialize(buffer, offset, entry.firstBlockAddress);
+    auto slots = readDirectory(blockAddress, size);
+    std::unique_lock cacheLock(cacheMutex);
 
-        directory.push_back(entry);
+    // Make room before inserting, so the new directory is never the one evicted. The sweep clears the reference of
+    // each directory it passes and evicts the first one not looked up since its last pass.
+    while (directoryCache.size() >= directoryCacheCapacity) {
+        auto victim = directoryCache.lower_bound(directoryCacheHand);
+        if (victim == directoryCache.end()) {
+            victim = directoryCache.begin();
+        }
+
+        if (victim->second.referenced.exchange(false, std::memory_order_relaxed)) {
+            directoryCacheHand = std::next(victim) != directoryCache.end() ? std::next(victim)->first : "";
+        } else {
+            directoryCache.erase(victim);
+        }
+    }
+
+    // The entry holds an atomic, so it is built in place.
+    auto& directory = directoryCache[key];
+    directory.slots = std::move(slots);
+    for (size_t slot = 0; slot < directory.slots.size(); slot++) {
+        if (directory.slots[slot]) {
+            directory.index[directory.slots[slot]->attributes.name] = slot;
+        }
     }
-    
     return directory;
 }
+
+void FAT12::eraseDirectoryCache(const Path& path) {
+    std::string key = directoryKey(path);
+    std::unique_lock cacheLock(cacheMutex);
+    directoryCache.erase(key);
+
+    // Descendants sort right after the "path/" prefix.
+    std::string prefix = key.back() == '/' ? key : key + "/";
+    auto it = directoryCache.lower_bound(prefix);
+    while (it != directoryCache.end() && it->first.starts_with(prefix)) {
+        it = directoryCache.erase(it);
+    }
+}
+
+std::string FAT12::directoryKey(const Path& path) {
+    // Joined like the chain of DirectoryLocks, so repeated and trailing separators drop out.
+    Path key;
+    for (auto& name : path) {
+        if (!name.empty()) {
+            key /= name;
+        }
+    }
+    return key.string();
+}
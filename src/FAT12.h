@@ -1,28 +1,67 @@
 #include "Disk.h"
+#include "BlockCache.h"
+#include "FreeSpace.h"
+#include "Journal.h"
+#include "DirectoryLocks.h"
+#include "Schema.h"
 #include <string>
+#include <string_view>
 #include <chrono>
 #include <vector>
 #include <array>
 #include <cstring>
 #include <filesystem>
+#include <map>
+#include <unordered_map>
+#include <thread>
+#include <limits>
+#include <optional>
+#include <condition_variable>
+#include <exception>
+#include <type_traits>
+#include <atomic>
 
+class ThreadPool;
+
+// Public operations can be called from several threads. Each locks the directories along its path, so operations
+// in independent subtrees run in parallel and readers do not block each other. A file handle must only be used by
+// one thread at a time.
 class FAT12 {
 public:
-    using BlockAddress = int16_t;
+    using BlockAddress = int32_t;
+    using FileSize = uint32_t;
     using Path = std::filesystem::path;
 
     struct FileAttributes {
         bool isDirectory;
         std::string name = "New File";
-        BlockAddress size = 0;
+        FileSize size = 0;
         bool canRead = true;
         bool canWrite = true;
         int64_t created;
         int64_t lastModified;
     };
 
-    FAT12(const std::string& diskPath, uint16_t blockSize);
-    FAT12(const std::string& diskPath);
+    // Creates a file system of blockCount blocks, FAT included.
+    FAT12(const std::string& diskPath, uint16_t blockSize, size_t blockCount = defaultBlockCount, Disk::Backend backend = Disk::Backend::File);
+    // Opens an existing file system. Throws UnsupportedFormatException for images of another format version, and
+    // CorruptImageException for a superblock out of bounds. Operations throw the latter for invalid metadata.
+    FAT12(const std::string& diskPath, Disk::Backend backend = Disk::Backend::File);
+    // Closes open files and flushes. Errors cannot leave the destructor, so callers that need to see them flush
+    // first.
+    ~FAT12();
+
+    static constexpr size_t defaultCacheCapacity = 256;
+    // Directories kept deserialized, on top of the blocks in the block cache.
+    static constexpr size_t directoryCacheCapacity = 64;
+    static constexpr size_t defaultBlockCount = 4096;
+    static constexpr size_t minBlockCount = 16;
+    static constexpr size_t maxBlockCount = std::numeric_limits<BlockAddress>::max();
+    static constexpr uint16_t formatVersion = 5;
+    static constexpr size_t maxNameLength = 91;
+    // The journal takes 1/32 of the image within these bounds.
+    static constexpr size_t minJournalBlockCount = 8;
+    static constexpr size_t maxJournalBlockCount = 4096;
 
     void writeAttributes(const Path& path, const FileAttributes& attributes);
     FileAttributes readAttributes(const Path& path);
@@ -31,97 +70,521 @@ public:
     std::vector<FileAttributes> listDirectory(const Path& path);
     void deleteDirectory(const Path& path);
 
+    // Existing files are rewritten in place: only changed blocks are written and only the tail is allocated or freed.
     void writeFile(const Path& path, const std::vector<char>& data);
+    void appendFile(const Path& path, const std::vector<char>& data);
     std::vector<char> readFile(const Path& path);
+    // Reads the file into buffer, up to buffer.size() bytes, and returns the number of bytes read. Blocks are read
+    // straight to their offset in buffer, so a buffer of the file's size receives the whole file without copies.
+    size_t readFile(const Path& path, std::span<char> buffer);
+
+    // Reads several files at once. Paths are resolved on the calling thread, then the blocks of all files
+    // are read with positional reads on the workers of pool. Callers reading in rounds pass the same pool.
+    std::vector<std::vector<char>> readFiles(const std::vector<Path>& paths, ThreadPool& pool);
+    std::vector<std::vector<char>> readFiles(const std::vector<Path>& paths, size_t threadCount = std::thread::hardware_concurrency());
     void deleteFile(const Path& path);
 
+    using FileHandle = int;
+
+    // Streaming access to a file. Opening for writing creates the file if it does not exist and truncate empties it.
+    // Size and last modification time are written to the directory entry when the handle is closed.
+    FileHandle open(const Path& path, bool write = false, bool truncate = false);
+    size_t read(FileHandle handle, size_t offset, std::span<char> buffer);
+    void write(FileHandle handle, size_t offset, std::span<const char> data);
+    // Cuts the file to size bytes, freeing the blocks past it. A size past the end leaves the file as it is.
+    void truncate(FileHandle handle, size_t size);
+    void close(FileHandle handle);
+    size_t size(FileHandle handle);
+
+    // Closes a handle opened for a write if the write throws before closing it. A file the handle created is
+    // removed again, so a failed write leaves no empty entry behind.
+    class HandleGuard {
+    public:
+        HandleGuard(FAT12& fs, FileHandle handle) : fs(fs), handle(handle) {}
+        ~HandleGuard() {
+            if (!released) {
+                fs.abandon(handle);
+            }
+        }
+
+        HandleGuard(const HandleGuard&) = delete;
+        HandleGuard& operator=(const HandleGuard&) = delete;
+
+        // Called once the handle is closed on the success path.
+        void release() { released = true; }
+    private:
+        FAT12& fs;
+        FileHandle handle;
+        bool released = false;
+    };
+
     std::string dump();
 
+    // Problems found by check, one line each starting with the path they were found at, and what it counted.
+    struct CheckReport {
+        std::vector<std::string> problems;
+        size_t fileCount = 0;
+        size_t directoryCount = 0;
+        size_t usedBlockCount = 0;
+        size_t orphanedBlockCount = 0;
+    };
+
+    // Checks the file system in time linear in the image size. One walk of the directory tree claims the blocks of
+    // every chain in an ownership bitmap, which finds loops, cross-links, out of range and free blocks in chains and
+    // chains that do not match their size, and one pass over the FAT finds in-use blocks no chain claimed. With
+    // repair, broken chains are cut, sizes fitted to their chains, invalid entries cleared, free slot lists and name
+    // indexes rebuilt and orphaned blocks freed. Repair throws FileInUseException while a file is open.
+    CheckReport check(bool repair = false);
+
+    // Runs of contiguous blocks in the chains below a path, before and after defragment, and what it moved.
+    struct DefragmentReport {
+        size_t chainCount = 0;
+        size_t fragmentedChainsBefore = 0;
+        size_t fragmentedChainsAfter = 0;
+        size_t fragmentsBefore = 0;
+        size_t fragmentsAfter = 0;
+        size_t movedChainCount = 0;
+        size_t movedBlockCount = 0;
+    };
+
+    // Moves the fragmented chains below path, of files, directories and name indexes, to the fewest runs of free
+    // blocks that hold them, most fragmented first, until maxBlockCount blocks were moved. Each move is flushed on its
+    // own before its old blocks can be reused, so a crash leaves every chain in its old or its new place, and running
+    // it again resumes a bounded run. Open files are not moved.
+    DefragmentReport defragment(const Path& path = "/", size_t maxBlockCount = SIZE_MAX);
+
+    // Writes all dirty blocks and the superblock to disk, once the operations in progress on other threads return.
+    // Public operations flush on return. Their flush runs in a destructor, so one that fails is rethrown here.
+    void flush();
+
+    // Defers flushing of the operations between beginBatch() and endBatch() to endBatch() or an explicit flush().
+    void beginBatch();
+    void endBatch();
+
+    void setCacheCapacity(size_t capacity);
+
+    // Counters and cumulative wall time of the hot paths since the file system was opened.
+    struct Stats {
+        Disk::Stats disk;
+        BlockCache::Stats cache;
+        CallStats readBlock;
+        CallStats writeBlock;
+        CallStats writeFat;
+        CallStats readDirectory;
+        CallStats writeDirectory;
+        CallStats pathToAddressAndSize;
+    };
+
+    Stats stats() const;
+
+    // Records a span for every instrumented call in trace, which must outlive the file system or be reset
+    // with nullptr first.
+    void setTrace(Trace* trace);
+
 private:
     static constexpr BlockAddress fatAddress() { return 0; }
+    static constexpr size_t compareSliceBlockCount = 64;
+    // Directories are arrays of fixed size slots, so the block and offset of an entry follow from its slot index.
+    static constexpr size_t directoryEntrySize = 128;
+    static constexpr size_t parallelReadSize = 256 * 1024;
+    // Bytes of a chain hinted to the disk ahead of the block being read.
+    static constexpr size_t readAheadSize = 1024 * 1024;
+    // Holes left by writes past the end are zeroed this many bytes at a time.
+    static constexpr size_t zeroFillSize = 64 * 1024;
     static constexpr BlockAddress freeBlockMarker() { return 0; }
     static constexpr BlockAddress lastBlockMarker() { return -1; }
-    BlockAddress dataAddress() const { return fatAddress() + (fat.size() * sizeof(BlockAddress)) / sb.blockSize; }
+    BlockAddress dataAddress() const { return fatAddress() + blockCount(fat.size() * sizeof(BlockAddress)); }
     constexpr BlockAddress maxAddress() const { return fat.size() - 1; }
+    // Blocks start at sector 1, after superblock.
+    size_t blockToSector(BlockAddress blockAddress) const { return 1 + (size_t)blockAddress * (sb.blockSize / Disk::sectorSize); }
+    size_t blockCount(size_t size) const { return (size + sb.blockSize - 1) / sb.blockSize; }
+    size_t entriesPerBlock() const { return sb.blockSize / directoryEntrySize; }
     int64_t getNow() const { return std::chrono::system_clock::now().time_since_epoch().count(); }
 
+    // Format version 1 had no version field; its block size is read in its place and rejected.
     struct Superblock {
         uint8_t partitionId = 1;
+        uint16_t formatVersion = FAT12::formatVersion;
         uint16_t blockSize;
-        BlockAddress rootDirectoryEntrySize = 0;
+        // Length of the FAT, which is the number of blocks in the image.
+        uint32_t blockCount;
+        FileSize rootDirectoryEntrySize = 0;
+        BlockAddress journalAddress = lastBlockMarker();
+        uint32_t journalBlockCount = 0;
     };
 
     struct DirectoryEntry {
         FileAttributes attributes;
         BlockAddress firstBlockAddress = lastBlockMarker();
+        // Directories only: chain of the name index, and first unused slot + 1 or 0.
+        BlockAddress indexBlockAddress = lastBlockMarker();
+        uint32_t freeSlotHead = 0;
+    };
+
+    // Name index of a directory that outgrew one block: a header followed by an open addressing hash table
+    // of buckets, probed linearly. Buckets hold the slot + firstSlotBucket, or one of the markers.
+    static constexpr size_t indexHeaderSize = 16;
+    static constexpr size_t indexBucketSize = 8;
+    static constexpr uint32_t emptyBucket = 0;
+    static constexpr uint32_t deletedBucket = 1;
+    static constexpr uint32_t firstSlotBucket = 2;
+
+    struct IndexHeader {
+        uint32_t bucketCount;
+        uint32_t usedBucketCount;
+        uint32_t entryCount;
+    };
+
+    struct IndexBucket {
+        uint32_t hash;
+        uint32_t slot;
+    };
+
+    // Unused directory slot, linked to the next unused slot + 1 or 0.
+    static constexpr uint8_t unusedSlot = 0;
+    static constexpr uint8_t usedSlot = 1;
+    struct FreeSlot {
+        uint32_t nextFreeSlot;
+    };
+
+    // On-disk encodings, little-endian and zero padded to the sector, slot or bucket that holds them.
+    using SuperblockLayout = schema::Layout<
+        schema::Field<&Superblock::partitionId>,
+        schema::Field<&Superblock::formatVersion>,
+        schema::Field<&Superblock::blockSize>,
+        schema::Field<&Superblock::blockCount>,
+        schema::Field<&Superblock::rootDirectoryEntrySize>,
+        schema::Field<&Superblock::journalAddress>,
+        schema::Field<&Superblock::journalBlockCount>>;
+
+    // Slots start with a used flag that tells an entry from an unused slot. Names end the slot.
+    using NameField = schema::StringField<maxNameLength, &DirectoryEntry::attributes, &FileAttributes::name>;
+    using EntryLayout = schema::Layout<
+        schema::Tag<usedSlot>,
+        schema::Field<&DirectoryEntry::attributes, &FileAttributes::isDirectory>,
+        schema::Field<&DirectoryEntry::attributes, &FileAttributes::canRead>,
+        schema::Field<&DirectoryEntry::attributes, &FileAttributes::canWrite>,
+        schema::Field<&DirectoryEntry::attributes, &FileAttributes::size>,
+        schema::Field<&DirectoryEntry::firstBlockAddress>,
+        schema::Field<&DirectoryEntry::indexBlockAddress>,
+        schema::Field<&DirectoryEntry::freeSlotHead>,
+        schema::Field<&DirectoryEntry::attributes, &FileAttributes::created>,
+        schema::Field<&DirectoryEntry::attributes, &FileAttributes::lastModified>,
+        NameField>;
+    static constexpr size_t nameOffset = directoryEntrySize - NameField::size;
+
+    using FreeSlotLayout = schema::Layout<
+        schema::Tag<unusedSlot>,
+        schema::Field<&FreeSlot::nextFreeSlot>>;
+
+    using IndexHeaderLayout = schema::Layout<
+        schema::Field<&IndexHeader::bucketCount>,
+        schema::Field<&IndexHeader::usedBucketCount>,
+        schema::Field<&IndexHeader::entryCount>>;
+
+    using IndexBucketLayout = schema::Layout<
+        schema::Field<&IndexBucket::hash>,
+        schema::Field<&IndexBucket::slot>>;
+
+    static_assert(SuperblockLayout::size <= Disk::sectorSize);
+    static_assert(EntryLayout::size == directoryEntrySize && FreeSlotLayout::size <= directoryEntrySize);
+    static_assert(IndexHeaderLayout::size <= indexHeaderSize && IndexBucketLayout::size == indexBucketSize);
+
+    struct OpenFile {
+        Path path;
+        BlockAddress firstBlockAddress;
+        size_t size;
+        bool canWrite;
+        bool modified = false;
+        // Whether opening created the file, so that a failed write removes it again.
+        bool created = false;
+
+        // Last visited block of the chain, so sequential access does not walk it from the start.
+        size_t cursorIndex = 0;
+        BlockAddress cursorAddress;
+
+        // Block index up to which the chain was hinted for read-ahead.
+        size_t prefetchEnd = 0;
+    };
+
+    // Deserialized directories by path: entries by slot and a name index into the slots.
+    struct CachedDirectory {
+        // Hashes any string type, so the index is searched with views.
+        struct NameHash {
+            using is_transparent = void;
+            size_t operator()(std::string_view name) const { return std::hash<std::string_view>{}(name); }
+        };
+
+        std::vector<std::optional<DirectoryEntry>> slots;
+        std::unordered_map<std::string, size_t, NameHash, std::equal_to<>> index;
+        // Set by lookups under the shared cacheMutex, so eviction passes over the directory once.
+        mutable std::atomic<bool> referenced = true;
     };
 
+    // Used entries of a directory read in place from its raw slots, such as those of a cached block. Names are
+    // views into the slots and entries are decoded only on request, so scanning a directory allocates nothing.
+    class DirectoryView {
+    public:
+        struct Entry {
+            size_t slot;
+            std::string_view name;
+            std::span<const char> bytes;
+        };
+
+        class Iterator {
+        public:
+            Iterator(const DirectoryView& view, size_t index) : view(&view), index(index) { skipUnused(); }
+            Entry operator*() const;
+            Iterator& operator++() { index++; skipUnused(); return *this; }
+            bool operator==(const Iterator& other) const { return index == other.index; }
+
+        private:
+            const DirectoryView* view;
+            size_t index;
+
+            void skipUnused();
+        };
+
+        // slots holds whole slots of the directory, starting with slot firstSlot.
+        DirectoryView(const FAT12& fs, std::span<const char> slots, size_t firstSlot = 0) :
+            fs(fs), slots(slots), firstSlot(firstSlot) {}
+
+        Iterator begin() const { return {*this, 0}; }
+        Iterator end() const { return {*this, slots.size() / directoryEntrySize}; }
+        // Stops at the first entry named name.
+        std::optional<Entry> find(std::string_view name) const;
+
+    private:
+        const FAT12& fs;
+        std::span<const char> slots;
+        size_t firstSlot;
+
+        std::span<const char> slot(size_t index) const { return slots.subspan(index * directoryEntrySize, directoryEntrySize); }
+    };
+
+    // Public operations that modify the file system. Blocks are flushed when the last active operation returns,
+    // so a transaction never holds part of an operation, and operations that start while that flush is pending
+    // wait for it. Nested calls on one thread count as one operation. Streaming writes do not ask for a flush.
+    // Constructed before any directory lock so that it is released after them.
+    class Operation {
+    public:
+        Operation(FAT12& fs, bool flushes = true) : fs(fs), flushes(flushes) { fs.beginOperation(); }
+        ~Operation() { fs.endOperation(flushes); }
+    private:
+        FAT12& fs;
+        bool flushes;
+    };
+
+    // Named in errors about the image.
+    std::string diskPath;
     Disk disk;
     Superblock sb;
-    std::array<BlockAddress, 4096> fat;
+    std::vector<BlockAddress> fat;
+    std::vector<bool> dirtyFatBlocks;
+    FreeSpace freeSpace;
+    BlockCache cache{defaultCacheCapacity};
+    std::optional<Journal> journal;
+    // Metadata blocks written since the last commit, and committed blocks not yet written to their home location.
+    std::map<BlockAddress, std::vector<char>> uncommittedBlocks;
+    std::map<BlockAddress, std::vector<char>> checkpointBlocks;
+    bool superblockDirty = false;
+    std::map<std::string, CachedDirectory> directoryCache;
+    // Where eviction resumes its sweep over directoryCache.
+    std::string directoryCacheHand;
+    std::map<FileHandle, OpenFile> openFiles;
+    FileHandle nextFileHandle = 0;
+
+    DirectoryLocks directoryLocks;
+    // Guards the FAT and free space: shared to walk a chain, exclusive to allocate or free. Taken after
+    // metadataMutex and before cacheMutex.
+    mutable std::shared_mutex fatMutex;
+    // Guards the block cache, the journal and the directory cache, for the duration of a directory update.
+    mutable std::recursive_mutex metadataMutex;
+    // Lets lookups read the block cache and the directory cache without metadataMutex, so readers do not wait for
+    // each other. Changes to either cache hold metadataMutex and take this exclusively. Always taken last.
+    mutable std::shared_mutex cacheMutex;
+    std::mutex openFilesMutex;
+
+    std::mutex operationMutex;
+    std::condition_variable operationsDone;
+    size_t activeOperations = 0;
+    int batchDepth = 0;
+    bool flushPending = false;
+    // The error of a flush that failed when an operation returned, for the next flush to throw.
+    std::exception_ptr flushError;
+    static thread_local int threadOperationDepth;
+
+    CallCounter readBlockCalls;
+    CallCounter writeBlockCalls;
+    CallCounter writeFatCalls;
+    CallCounter readDirectoryCalls;
+    CallCounter writeDirectoryCalls;
+    CallCounter pathToAddressAndSizeCalls;
+    Trace* trace = nullptr;
 
     std::string dumpDirectory(const Path& path, int indent, int& fileCount, int& directoryCount);
 
+    // Walk of check over the directory tree. Defined in FAT12.cpp.
+    struct CheckState;
+    struct ClaimedChain {
+        std::vector<BlockAddress> blocks;
+        std::optional<std::string> problem;
+    };
+
+    // Claims the blocks of the chain at firstBlockAddress, up to maxBlockCount, until one is out of range, free
+    // or already claimed.
+    ClaimedChain claimChain(CheckState& state, BlockAddress firstBlockAddress, size_t maxBlockCount);
+    // Claims the chain of entry and fits its size to it. Returns whether entry changed.
+    bool checkChain(CheckState& state, const Path& path, DirectoryEntry& entry);
+    // Checks the slots, free slot list and name index of the directory whose entry is entry. Returns whether it
+    // needs a new name index, which is built once orphaned blocks are freed.
+    bool checkDirectory(CheckState& state, const Path& path, DirectoryEntry& entry, const std::vector<char>& slots, bool& changed);
+    bool checkIndex(CheckState& state, const DirectoryEntry& directory, const std::vector<char>& slots, const std::vector<bool>& used);
+
+    // A chain of the tree and its number of runs of contiguous blocks, for defragment.
+    struct ChainFragments {
+        Path path;
+        bool isIndex;
+        size_t fragmentCount;
+    };
+
+    std::vector<ChainFragments> chainFragments(const Path& path);
+    // Moves the chain to fewer runs if free space has them, unless it is longer than maxBlockCount. Returns the
+    // number of blocks moved.
+    size_t moveChain(const ChainFragments& chain, size_t maxBlockCount);
+
     void checkIsDirectory(const Path& path, bool shouldBeDirectory);
     void checkPermission(const Path& path, const std::string& permission);
 
     Path pathToName(const Path& path);
     Path parentPath(const Path& path);
 
+    void beginOperation();
+    void endOperation(bool flushes);
+    // Commits the dirty blocks and writes the superblock. No operation may be in progress.
+    void flushBlocks();
+
     void writeSuperblock();
     void readSuperblock();
     void writeFat();
     void readFat();
+    void setFat(BlockAddress blockAddress, BlockAddress value);
+    void buildFreeSpace();
 
     void writeBlock(BlockAddress blockAddress, const std::vector<char>& block);
     std::vector<char> readBlock(BlockAddress blockAddress);
-    BlockAddress writeBlocks(BlockAddress blockAddress, const std::vector<char>& buffer);
-    std::vector<char> readBlocks(BlockAddress blockAddress);
+    // Calls visit with the block. A cached block is visited under a shared lock, so visit must not take locks or
+    // read other blocks.
+    // The return type is spelled out so the function can be called above its definition.
+    template<typename Visit>
+    std::invoke_result_t<Visit, const std::vector<char>&> visitBlock(BlockAddress blockAddress, Visit visit);
+    // Like readBlock, but returns the block in the cache instead of a copy. The caller holds metadataMutex, and
+    // the block is only valid until the next block is read or written.
+    const std::vector<char>& cachedBlock(BlockAddress blockAddress);
+    void writeBlockToDisk(BlockAddress blockAddress, const std::vector<char>& block);
+    std::vector<char> readBlockFromDisk(BlockAddress blockAddress);
+    void writeBack(const std::vector<BlockCache::Block>& blocks);
+
+    // Metadata reaches its home location only through the journal: flush commits the blocks written since the
+    // last flush as one transaction, and checkpoint writes committed blocks home once the journal is full.
+    void commit();
+    void checkpoint();
+    const std::vector<char>* journaledBlock(BlockAddress blockAddress) const;
+    void keepUncommitted(std::vector<BlockCache::Block> blocks);
+    // Directories go through the block cache, file data is transferred directly one contiguous run at a time.
+    std::vector<char> readBlocks(BlockAddress blockAddress, bool cached = true);
+    // Reads the blocks of chain into destination, which may end inside the last block if they are not cached.
+    void readBlocks(const std::vector<BlockAddress>& chain, std::span<char> destination, bool cached);
+    void writeExtent(BlockAddress blockAddress, std::span<const char> data);
+
+    // Hints the runs of chain from index begin on, up to readAheadSize bytes, that are not hinted yet. prefetchEnd
+    // is the index up to which chain is hinted.
+    void prefetch(const std::vector<BlockAddress>& chain, size_t begin, size_t& prefetchEnd);
+    void prefetch(OpenFile& file, size_t blockIndex);
+
+    // Allocates blockCount blocks and links them into a chain, after prevAddress if it is not lastBlockMarker().
+    std::vector<FreeSpace::Extent> allocateBlocks(size_t blockCount, BlockAddress prevAddress);
+    BlockAddress linkExtent(const FreeSpace::Extent& extent, BlockAddress prevAddress);
+    // File data bypasses the journal, so replaying it must not overwrite file data in reused metadata blocks.
+    // Checkpoints if extents hold blocks the journal has yet to write home.
+    void checkpointReusedBlocks(const std::vector<FreeSpace::Extent>& extents);
+
+    void createFile(const Path& path);
+    void resize(OpenFile& file, size_t size);
+    void writeChangedBlocks(BlockAddress blockAddress, size_t blockIndex, size_t blockCount, size_t oldSize, std::span<const char> data);
+    bool blockChanged(const std::vector<char>& run, size_t runIndex, size_t blockIndex, size_t oldSize, std::span<const char> data);
+
+    OpenFile& openFile(FileHandle handle);
+    // Closes a handle after a failed write, removing its file if it created it. Errors are dropped, since the one
+    // that made the write fail is already propagating.
+    void abandon(FileHandle handle) noexcept;
+    // Whether a handle is open on path, or with below, on path or anything below it. Handles do not share state, so
+    // their paths are not freed, truncated, renamed or written through a second handle while they are open.
+    bool isOpen(const Path& path, bool below = false);
+    BlockAddress seek(OpenFile& file, size_t blockIndex);
+
+    // Calls transfer(blockIndex, blockAddress, blockCount) for each contiguous run of blocks covering [offset, offset + length).
+    template<typename Transfer>
+    void forEachRun(OpenFile& file, size_t offset, size_t length, Transfer transfer);
+
+    // Addresses of the first blockCount blocks of the chain starting at blockAddress, or of all of them.
+    std::vector<BlockAddress> chainAddresses(BlockAddress blockAddress, size_t blockCount = SIZE_MAX);
+    // Contiguous runs of the first blockCount blocks of the chain starting at blockAddress, in chain order.
+    std::vector<FreeSpace::Extent> chainExtents(BlockAddress blockAddress, size_t blockCount = SIZE_MAX);
+    // Throws CorruptImageException unless a chain may continue at blockAddress, so a corrupt FAT is never indexed out of range.
+    void checkChainAddress(BlockAddress blockAddress) const;
 
     void freeBlocks(const Path& path);
     void freeBlocks(BlockAddress blockAddress);
+    // Frees the blocks of a directory and everything below it, leaving its entry in place.
+    void freeDirectory(const Path& path);
 
+    // Entries are added to a free slot of the parent, removed by putting their slot on the parent's free list
+    // and updated in place. Each writes one block of the parent and its index, plus the parent's own entry for
+    // the new size and modification time.
+    void addDirectoryEntry(const Path& path, const DirectoryEntry& entry);
+    void removeDirectoryEntry(const Path& path);
     void writeDirectoryEntry(const Path& path, const DirectoryEntry& directoryEntry);
+    // The empty path yields an entry for the directory that contains root directory entry.
     DirectoryEntry readDirectoryEntry(const Path& path);
+    void touchDirectory(const Path& path, DirectoryEntry& directory);
 
-    BlockAddress writeDirectory(const Path& path, const std::vector<DirectoryEntry>& directory, bool updateLastModified = false);
+    // Slot index and entry of name in the directory at path, whose entry is directory.
+    std::optional<std::pair<size_t, DirectoryEntry>> findEntry(const Path& path, const DirectoryEntry& directory, std::string_view name);
+
+    // Writes one slot of the directory whose chain starts at blockAddress. Empty entries mark the slot unused
+    // and link it to nextFreeSlot.
+    void writeDirectory(BlockAddress blockAddress, size_t slot, const std::optional<DirectoryEntry>& entry, uint32_t nextFreeSlot = 0);
+    std::optional<DirectoryEntry> readDirectorySlot(BlockAddress blockAddress, size_t slot, uint32_t* nextFreeSlot = nullptr);
+    // Throws unless slot holds the entry named name, so a stale slot number never overwrites or frees another entry.
+    void checkSlotName(const DirectoryEntry& directory, size_t slot, std::string_view name);
     std::vector<DirectoryEntry> readDirectory(const Path& path);
 
-    std::pair<BlockAddress, BlockAddress> pathToAddressAndSize(const Path& path);
-    std::vector<DirectoryEntry> readDirectory(BlockAddress blockAddress, BlockAddress size);
-
-    template<typename T>
-    void serialize(std::vector<char>& buffer, const T& data) const {
-        static_assert(std::is_integral<T>::value);
-
-        buffer.resize(buffer.size() + sizeof(T));
-        std::memcpy(buffer.data() + buffer.size() - sizeof(T), &data, sizeof(T));
-    }
-
-    void serialize(std::vector<char>& buffer, const std::string& data) const {
-        size_t length = data.size();
-        buffer.resize(buffer.size() + sizeof(length));
-        std::memcpy(buffer.data() + buffer.size() - sizeof(length), &length, sizeof(length));
-
-        buffer.resize(buffer.size() + length);
-        std::memcpy(buffer.data() + buffer.size() - length, data.data(), length);
-    }
-
-    template<typename T>
-    void deserialize(const std::vector<char>& buffer, size_t& offset, T& data) const {
-        static_assert(std::is_integral<T>::value);
-
-        std::memcpy(&data, buffer.data() + offset, sizeof(T));
-        offset += sizeof(T);
-    }
-    
-    void deserialize(const std::vector<char>& buffer, size_t& offset, std::string& data) const {
-        size_t length;
-        std::memcpy(&length, buffer.data() + offset, sizeof(length));
-        offset += sizeof(length);
-
-        data.resize(length);
-        std::memcpy(data.data(), buffer.data() + offset, length);
-        offset += length;
-    }
+    std::pair<BlockAddress, FileSize> pathToAddressAndSize(const Path& path);
+    std::vector<std::optional<DirectoryEntry>> readDirectory(BlockAddress blockAddress, FileSize size);
+    BlockAddress chainAddress(BlockAddress blockAddress, size_t blockIndex) const;
+
+    void serializeEntry(std::span<char> slot, const std::optional<DirectoryEntry>& entry, uint32_t nextFreeSlot = 0) const;
+    std::optional<DirectoryEntry> deserializeEntry(std::span<const char> slot, uint32_t* nextFreeSlot = nullptr) const;
+
+    static uint32_t nameHash(std::string_view name);
+    IndexHeader readIndexHeader(BlockAddress indexAddress);
+    void writeIndexHeader(BlockAddress indexAddress, const IndexHeader& header);
+    IndexBucket readIndexBucket(BlockAddress indexAddress, uint32_t bucket);
+    void writeIndexBucket(BlockAddress indexAddress, uint32_t bucket, const IndexBucket& value);
+    std::optional<std::pair<size_t, DirectoryEntry>> lookupIndex(const DirectoryEntry& directory, std::string_view name);
+    // Adding may rebuild the index into a new chain, so directory's entry must be written afterwards.
+    void insertIndex(const Path& path, DirectoryEntry& directory, const std::string& name, size_t slot);
+    void removeIndex(const DirectoryEntry& directory, const std::string& name, size_t slot);
+    // Rebuilds into extents when given, which must hold indexBlockCount of the directory's entries.
+    void buildIndex(const Path& path, DirectoryEntry& directory, std::vector<FreeSpace::Extent> extents = {});
+    uint32_t indexBucketCount(size_t entryCount) const;
+    size_t indexBlockCount(size_t entryCount) const;
+
+    // Returns the directory from directoryCache, loading it if needed. The caller holds metadataMutex, and the
+    // directory is only valid until the next one is loaded.
+    CachedDirectory& cachedDirectory(const Path& path, BlockAddress blockAddress, FileSize size);
+    void eraseDirectoryCache(const Path& path);
+    // Key of a directory in directoryCache. Spellings of one directory, such as /a//b and /a/b/, share it.
+    static std::string directoryKey(const Path& path);
 };
@@ -0,0 +1,107 @@
+#include "FreeSpace.h"
+#include <algorithm>
+#include <cassert>
+
+FreeSpace::FreeSpace(size_t blockCount) :
+    words((blockCount + 63) / 64, 0),
+    blocks(blockCount)
+{
+}
+
+void FreeSpace::markFree(size_t address) {
+    assert(address < blocks);
+
+    if (isFree(address)) {
+        return;
+    }
+
+    markRunFree(address, 1);
+}
+
+void FreeSpace::markRunFree(size_t address, size_t length) {
+    assert(address + length <= blocks);
+
+    for (size_t i = address; i < address + length; i++) {
+        assert(!isFree(i));
+        words[i / 64] |= uint64_t(1) << (i % 64);
+    }
+    count += length;
+
+    // Merge with the runs ending right before and starting right after the blocks.
+    size_t begin = address;
+    size_t end = address + length;
+
+    auto next = runs.find(end);
+    if (next != runs.end()) {
+        end += next->second;
+        removeRun(next);
+    }
+
+    auto prev = runs.lower_bound(address);
+    if (prev != runs.begin() && (--prev)->first + prev->second == address) {
+        begin = prev->first;
+        removeRun(prev);
+    }
+
+    addRun(begin, end - begin);
+}
+
+void FreeSpace::markUsed(size_t address) {
+    assert(address < blocks);
+
+    if (!isFree(address)) {
+        return;
+    }
+
+    words[address / 64] &= ~(uint64_t(1) << (address % 64));
+    count--;
+
+    // Split the run containing the block.
+    auto run = std::prev(runs.upper_bound(address));
+    size_t begin = run->first;
+    size_t end = run->first + run->second;
+    removeRun(run);
+
+    if (begin < address) {
+        addRun(begin, address - begin);
+    }
+    if (address + 1 < end) {
+        addRun(address + 1, end - address - 1);
+    }
+}
+
+std::vector<FreeSpace::Extent> FreeSpace::findExtents(size_t count) const {
+    assert(count <= this->count);
+
+    std::vector<Extent> extents;
+
+    // Runs from limit to the end of runsByLength are already taken.
+    auto limit = runsByLength.end();
+
+    while (count > 0) {
+        // Best fit for the rest of the request.
+        auto fit = runsByLength.lower_bound({count, 0});
+        if (fit != runsByLength.end() && (limit == runsByLength.end() || *fit < *limit)) {
+            extents.push_back({fit->second, count});
+            break;
+        }
+
+        // Nothing fits, take the largest remaining run whole.
+        limit--;
+        extents.push_back({limit->second, limit->first});
+        count -= limit->first;
+    }
+
+    std::sort(extents.begin(), extents.end(), [](const Extent& a, const Extent& b) { return a.address < b.address; });
+    return extents;
+}
+
+void FreeSpace::addRun(size_t address, size_t length) {
+    runs[address] = length;
+    runsByLength.insert({length, address});
+}
+
+void FreeSpace::removeRun(std::map<size_t, size_t>::iterator run) {
+    runsByLength.erase({run->second, run->first});
+    runs.erase(run);
+}
@@ -0,0 +1,43 @@
+#include <vector>
+#include <map>
+#include <set>
+#include <cstdint>
+#include <cstddef>
+
+// Free blocks, kept both as a bitmap and as runs of contiguous free blocks indexed by start and by length.
+class FreeSpace {
+public:
+    struct Extent {
+        size_t address;
+        size_t length;
+    };
+
+    // All blocks start out used.
+    FreeSpace(size_t blockCount = 0);
+
+    void markFree(size_t address);
+    // Marks length blocks starting at address free at once. They must all be used.
+    void markRunFree(size_t address, size_t length);
+    void markUsed(size_t address);
+    bool isFree(size_t address) const { return words[address / 64] >> (address % 64) & 1; }
+
+    // Chooses free extents holding count blocks, sorted by address. The smallest run that fits the whole
+    // request is preferred; otherwise the largest runs are taken first so the result has as few extents as possible.
+    std::vector<Extent> findExtents(size_t count) const;
+
+    size_t freeCount() const { return count; }
+    size_t blockCount() const { return blocks; }
+    size_t runCount() const { return runs.size(); }
+
+private:
+    std::vector<uint64_t> words;
+    size_t blocks;
+    size_t count = 0;
+
+    // Start to length, and (length, start) for best-fit lookups.
+    std::map<size_t, size_t> runs;
+    std::set<std::pair<size_t, size_t>> runsByLength;
+
+    void addRun(size_t address, size_t length);
+    void removeRun(std::map<size_t, size_t>::iterator run);
+};
@@ -0,0 +1,136 @@
+#include "Journal.h"
+#include "Disk.h"
+#include "Schema.h"
+#include <cassert>
+
+namespace {
+    // Little-endian, like every other on-disk field, so journals replay on any host.
+    template<typename T>
+    void put(std::vector<char>& buffer, size_t offset, T value) {
+        assert(offset + sizeof(T) <= buffer.size());
+        schema::store(buffer.data() + offset, value);
+    }
+
+    template<typename T>
+    T get(const std::vector<char>& buffer, size_t offset) {
+        assert(offset + sizeof(T) <= buffer.size());
+        return schema::load<T>(buffer.data() + offset);
+    }
+
+    // FNV-1a, continued from hash.
+    uint32_t checksum(std::span<const char> data, uint32_t hash = 2166136261u) {
+        for (unsigned char c : data) {
+            hash ^= c;
+            hash *= 16777619u;
+        }
+        return hash;
+    }
+}
+
+Journal::Journal(Disk& disk, size_t firstSector, size_t blockSize, size_t blockCount) :
+    disk(disk),
+    firstSector(firstSector),
+    blockSize(blockSize),
+    blockCount(blockCount)
+{
+    assert(blockSize % Disk::sectorSize == 0);
+    assert(blockCount >= 2);
+}
+
+std::vector<Journal::Record> Journal::replay() {
+    std::vector<Record> records;
+    std::vector<char> header(blockSize);
+    disk.read(blockToSector(0), header);
+
+    // Not initialized yet, nothing to replay.
+    if (get<uint32_t>(header, 0) != headerMagic) {
+        reset();
+        return records;
+    }
+
+    sequence = get<uint64_t>(header, 8);
+    head = 1;
+
+    while (head < blockCount) {
+        std::vector<char> descriptor(blockSize);
+        disk.read(blockToSector(head), descriptor);
+        if (get<uint32_t>(descriptor, 0) != descriptorMagic || get<uint64_t>(descriptor, 8) != sequence) {
+            break;
+        }
+
+        size_t recordCount = get<uint32_t>(descriptor, 4);
+        size_t length = transactionBlockCount(recordCount);
+        if (head + length > blockCount) {
+            break;
+        }
+
+        std::vector<char> transaction(length * blockSize);
+        disk.read(blockToSector(head), transaction);
+
+        size_t dataOffset = descriptorBlockCount(recordCount) * blockSize;
+        size_t commitOffset = dataOffset + recordCount * blockSize;
+        uint32_t sum = checksum(std::span<const char>(transaction).first(commitOffset));
+        if (get<uint32_t>(transaction, commitOffset) != commitMagic || get<uint64_t>(transaction, commitOffset + 8) != sequence ||
+            get<uint32_t>(transaction, commitOffset + 4) != sum) {
+            break;
+        }
+
+        for (size_t i = 0; i < recordCount; i++) {
+            auto data = transaction.begin() + dataOffset + i * blockSize;
+            records.push_back({get<uint32_t>(transaction, descriptorHeaderSize + i * sizeof(uint32_t)), std::vector<char>(data, data + blockSize)});
+        }
+
+        head += length;
+        sequence++;
+    }
+
+    return records;
+}
+
+void Journal::reset() {
+    std::vector<char> header(blockSize);
+    put(header, 0, headerMagic);
+    put(header, 8, sequence);
+    disk.write(blockToSector(0), header);
+    disk.sync();
+
+    head = 1;
+}
+
+void Journal::commit(const std::vector<size_t>& addresses, const std::vector<std::span<const char>>& blocks) {
+    assert(addresses.size() == blocks.size());
+    assert(fits(addresses.size()));
+
+    size_t recordCount = addresses.size();
+    std::vector<char> descriptor(descriptorBlockCount(recordCount) * blockSize);
+    put(descriptor, 0, descriptorMagic);
+    put(descriptor, 4, (uint32_t)recordCount);
+    put(descriptor, 8, sequence);
+    for (size_t i = 0; i < recordCount; i++) {
+        put(descriptor, descriptorHeaderSize + i * sizeof(uint32_t), (uint32_t)addresses[i]);
+    }
+
+    uint32_t sum = checksum(descriptor);
+    for (auto& block : blocks) {
+        assert(block.size() == blockSize);
+        sum = checksum(block, sum);
+    }
+
+    std::vector<char> commitBlock(blockSize);
+    put(commitBlock, 0, commitMagic);
+    put(commitBlock, 4, sum);
+    put(commitBlock, 8, sequence);
+
+    std::vector<std::span<const char>> buffers = {descriptor};
+    buffers.insert(buffers.end(), blocks.begin(), blocks.end());
+    buffers.push_back(commitBlock);
+    disk.writev(blockToSector(head), buffers);
+    disk.sync();
+
+    head += transactionBlockCount(recordCount);
+    sequence++;
+}
+
+size_t Journal::blockToSector(size_t block) const {
+    return firstSector + block * (blockSize / Disk::sectorSize);
+}
@@ -0,0 +1,50 @@
+#include <cstdint>
+#include <cstddef>
+#include <span>
+#include <vector>
+
+class Disk;
+
+// Write-ahead log of metadata blocks in a fixed region of the disk. Each commit appends one transaction with a
+// single sequential write: descriptor blocks listing the home addresses, the block images and a commit block with
+// a checksum over both. Transactions that are torn or left over from before the last reset are not replayed.
+class Journal {
+public:
+    struct Record {
+        size_t address;
+        std::vector<char> data;
+    };
+
+    // The journal occupies blockCount blocks of blockSize bytes starting at firstSector.
+    Journal(Disk& disk, size_t firstSector, size_t blockSize, size_t blockCount);
+
+    // Returns the records of the complete transactions since the last reset, oldest first, and appends after them.
+    std::vector<Record> replay();
+
+    // Starts over with an empty journal. Every committed record must have reached its home location first.
+    void reset();
+
+    // Whether a transaction of recordCount blocks fits in the space left.
+    bool fits(size_t recordCount) const { return head + transactionBlockCount(recordCount) <= blockCount; }
+
+    void commit(const std::vector<size_t>& addresses, const std::vector<std::span<const char>>& blocks);
+
+private:
+    static constexpr uint32_t headerMagic = 0x52444846;      // "FHDR"
+    static constexpr uint32_t descriptorMagic = 0x43534446;  // "FDSC"
+    static constexpr uint32_t commitMagic = 0x544d4346;      // "FCMT"
+    static constexpr size_t descriptorHeaderSize = 16;
+
+    Disk& disk;
+    size_t firstSector;
+    size_t blockSize;
+    size_t blockCount;
+
+    // Block 0 holds the sequence number of the first transaction, which starts at block 1.
+    size_t head = 1;
+    uint64_t sequence = 0;
+
+    size_t descriptorBlockCount(size_t recordCount) const { return (descriptorHeaderSize + recordCount * sizeof(uint32_t) + blockSize - 1) / blockSize; }
+    size_t transactionBlockCount(size_t recordCount) const { return descriptorBlockCount(recordCount) + recordCount + 1; }
+    size_t blockToSector(size_t block) const;
+};
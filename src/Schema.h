@@ -0,0 +1,152 @@
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+
+// Compile-time layouts of on-disk records. A Layout lists the fields of a record in encoding order, each with a
+// fixed size little-endian encoding, so the encoded size of a record is a constant and records are encoded in place
+// without allocating. Decoding checks the source length and every field, and fails on encodings no image contains.
+namespace schema {
+    template<typename T>
+    constexpr void store(char* destination, T value) {
+        static_assert(std::is_integral_v<T> && !std::is_same_v<T, bool>);
+        auto bits = static_cast<std::make_unsigned_t<T>>(value);
+        for (size_t i = 0; i < sizeof(T); i++) {
+            destination[i] = static_cast<char>(bits >> (8 * i) & 0xff);
+        }
+    }
+
+    template<typename T>
+    constexpr T load(const char* source) {
+        static_assert(std::is_integral_v<T> && !std::is_same_v<T, bool>);
+        using Bits = std::make_unsigned_t<T>;
+        Bits bits = 0;
+        for (size_t i = 0; i < sizeof(T); i++) {
+            bits |= static_cast<Bits>(static_cast<Bits>(static_cast<unsigned char>(source[i])) << (8 * i));
+        }
+        return static_cast<T>(bits);
+    }
+
+    template<typename> struct MemberPointer;
+    template<typename Class, typename Value> struct MemberPointer<Value Class::*> { using Type = Value; };
+
+    // Type of the member that a chain of pointers to members leads to.
+    template<auto... Members>
+    using MemberType = typename MemberPointer<std::tuple_element_t<sizeof...(Members) - 1, std::tuple<decltype(Members)...>>>::Type;
+
+    // Follows a chain of pointers to members, so that fields of nested structs can be described.
+    template<auto Member, auto... Members, typename Record>
+    constexpr auto& member(Record& record) {
+        if constexpr (sizeof...(Members) == 0) {
+            return record.*Member;
+        } else {
+            return member<Members...>(record.*Member);
+        }
+    }
+
+    // An integer member, or a bool member stored as one byte that must be 0 or 1.
+    template<auto... Members>
+    struct Field {
+        using Type = MemberType<Members...>;
+        using Stored = std::conditional_t<std::is_same_v<Type, bool>, uint8_t, Type>;
+        static constexpr size_t size = sizeof(Stored);
+
+        template<typename Record>
+        static constexpr void encode(const Record& record, char* destination) {
+            store<Stored>(destination, static_cast<Stored>(member<Members...>(record)));
+        }
+
+        template<typename Record>
+        static constexpr bool decode(const char* source, Record& record) {
+            Stored stored = load<Stored>(source);
+            if constexpr (std::is_same_v<Type, bool>) {
+                if (stored > 1) {
+                    return false;
+                }
+            }
+            member<Members...>(record) = static_cast<Type>(stored);
+            return true;
+        }
+    };
+
+    // A string member stored as a one byte length followed by maxLength bytes, zero padded.
+    template<size_t maxLength, auto... Members>
+    struct StringField {
+        static_assert(maxLength <= UINT8_MAX);
+        static constexpr size_t size = 1 + maxLength;
+
+        template<typename Record>
+        static constexpr void encode(const Record& record, char* destination) {
+            const std::string& value = member<Members...>(record);
+            assert(value.size() <= maxLength);
+            destination[0] = static_cast<char>(value.size());
+            std::copy(value.begin(), value.end(), destination + 1);
+            std::fill(destination + 1 + value.size(), destination + size, 0);
+        }
+
+        template<typename Record>
+        static constexpr bool decode(const char* source, Record& record) {
+            size_t length = static_cast<unsigned char>(source[0]);
+            if (length > maxLength) {
+                return false;
+            }
+            member<Members...>(record).assign(source + 1, length);
+            return true;
+        }
+
+        // The encoded string as a view into source, or nullopt if its length is invalid.
+        static constexpr std::optional<std::string_view> view(const char* source) {
+            size_t length = static_cast<unsigned char>(source[0]);
+            if (length > maxLength) {
+                return std::nullopt;
+            }
+            return std::string_view(source + 1, length);
+        }
+    };
+
+    // A constant that tells records apart, such as the used flag of a directory slot. It does not map to a member.
+    template<auto value>
+    struct Tag {
+        static constexpr size_t size = sizeof(value);
+
+        template<typename Record>
+        static constexpr void encode(const Record&, char* destination) {
+            store(destination, value);
+        }
+
+        template<typename Record>
+        static constexpr bool decode(const char* source, Record&) {
+            return load<decltype(value)>(source) == value;
+        }
+    };
+
+    template<typename... Fields>
+    struct Layout {
+        static constexpr size_t size = (Fields::size + ...);
+
+        // Encodes record into the first size bytes of destination.
+        template<typename Record>
+        static constexpr void encode(const Record& record, std::span<char> destination) {
+            assert(destination.size() >= size);
+            char* position = destination.data();
+            ((Fields::encode(record, position), position += Fields::size), ...);
+        }
+
+        // Decodes record from the first size bytes of source. Returns false if source is shorter than that or
+        // holds an invalid field, in which case record is partially assigned.
+        template<typename Record>
+        static constexpr bool decode(std::span<const char> source, Record& record) {
+            if (source.size() < size) {
+                return false;
+            }
+            const char* position = source.data();
+            return ((Fields::decode(position, record) && (position += Fields::size, true)) && ...);
+        }
+    };
+}
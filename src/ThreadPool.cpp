@@ -0,0 +1,39 @@
+#include "ThreadPool.h"
+#include <algorithm>
+
+ThreadPool::ThreadPool(size_t threadCount) {
+    threadCount = std::max<size_t>(threadCount, 1);
+
+    for (size_t i = 0; i < threadCount; i++) {
+        workers.emplace_back([this]() {
+            while (true) {
+                std::function<void()> task;
+
+                {
+                    std::unique_lock lock(mutex);
+                    condition.wait(lock, [this]() { return stopping || !tasks.empty(); });
+                    if (tasks.empty()) {
+                        return;
+                    }
+                    task = std::move(tasks.front());
+                    tasks.pop();
+                }
+
+                task();
+            }
+        });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard lock(mutex);
+        stopping = true;
+    }
+    condition.notify_all();
+
+    // Remaining tasks are finished before the workers exit.
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
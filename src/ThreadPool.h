@@ -0,0 +1,41 @@
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+
+// Fixed set of worker threads running submitted tasks in submission order.
+class ThreadPool {
+public:
+    ThreadPool(size_t threadCount = std::thread::hardware_concurrency());
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Runs task on a worker. Exceptions thrown by the task are rethrown by the returned future.
+    template<typename Task>
+    auto submit(Task task) -> std::future<decltype(task())> {
+        auto packaged = std::make_shared<std::packaged_task<decltype(task())()>>(std::move(task));
+        auto future = packaged->get_future();
+
+        {
+            std::lock_guard lock(mutex);
+            tasks.push([packaged]() { (*packaged)(); });
+        }
+        condition.notify_one();
+
+        return future;
+    }
+
+    size_t size() const { return workers.size(); }
+
+private:
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool stopping = false;
+};
@@ -0,0 +1,47 @@
+#include "Trace.h"
+#include <map>
+#include <iomanip>
+
+void Trace::record(std::string name, Clock::time_point start, Clock::time_point end) {
+    std::lock_guard lock(mutex);
+    events.push_back({std::move(name), start, end, std::this_thread::get_id()});
+}
+
+void Trace::write(std::ostream& out) const {
+    std::lock_guard lock(mutex);
+
+    // Trace viewers expect small integer thread ids.
+    std::map<std::thread::id, size_t> threadIds;
+
+    auto flags = out.flags();
+    auto precision = out.precision(3);
+    out << std::fixed << "{\"traceEvents\":[";
+    for (size_t i = 0; i < events.size(); i++) {
+        auto& event = events[i];
+        auto [thread, inserted] = threadIds.try_emplace(event.thread, threadIds.size() + 1);
+        std::chrono::duration<double, std::micro> start = event.start - origin;
+        std::chrono::duration<double, std::micro> duration = event.end - event.start;
+
+        out << (i == 0 ? "\n" : ",\n");
+        out << "{\"name\":\"";
+        for (char c : event.name) {
+            if (c == '"' || c == '\\') {
+                out << '\\';
+            }
+            out << c;
+        }
+        out << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << thread->second;
+        out << ",\"ts\":" << start.count() << ",\"dur\":" << duration.count() << "}";
+    }
+    out << "\n]}\n";
+    out.flags(flags);
+    out.precision(precision);
+}
+
+ScopedTimer::~ScopedTimer() {
+    auto end = Trace::Clock::now();
+    counter.add(end - start);
+    if (trace) {
+        trace->record(name, start, end);
+    }
+}
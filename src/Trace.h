@@ -0,0 +1,66 @@
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Call count and cumulative wall time of an instrumented function.
+struct CallStats {
+    size_t calls = 0;
+    std::chrono::nanoseconds time{0};
+};
+
+// Accumulates CallStats. Safe to update from several threads.
+class CallCounter {
+public:
+    void add(std::chrono::nanoseconds time) {
+        calls.fetch_add(1, std::memory_order_relaxed);
+        nanoseconds.fetch_add(time.count(), std::memory_order_relaxed);
+    }
+
+    CallStats value() const { return {calls, std::chrono::nanoseconds(nanoseconds)}; }
+
+private:
+    std::atomic<size_t> calls = 0;
+    std::atomic<int64_t> nanoseconds = 0;
+};
+
+// Per-call spans of instrumented functions, written in Chrome trace event format (chrome://tracing, Perfetto).
+class Trace {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    void record(std::string name, Clock::time_point start, Clock::time_point end);
+    void write(std::ostream& out) const;
+
+private:
+    struct Event {
+        std::string name;
+        Clock::time_point start;
+        Clock::time_point end;
+        std::thread::id thread;
+    };
+
+    Clock::time_point origin = Clock::now();
+    mutable std::mutex mutex;
+    std::vector<Event> events;
+};
+
+// Times the enclosing scope into counter, and into trace as well if it is not null.
+class ScopedTimer {
+public:
+    ScopedTimer(const char* name, CallCounter& counter, Trace* trace) :
+        name(name), counter(counter), trace(trace), start(Trace::Clock::now()) {}
+    ~ScopedTimer();
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+    const char* name;
+    CallCounter& counter;
+    Trace* trace;
+    Trace::Clock::time_point start;
+};
@@ -30,6 +30,12 @@ public:
         FileSystemException(path, "Cannot create directory: File exists.") {}
 };
 
+class NameTooLongException : public FileSystemException {
+public:
+    NameTooLongException(const std::string& path) :
+        FileSystemException(path, "File name too long.") {}
+};
+
 class PermissionException : public FileSystemException {
 public:
     PermissionException(const std::string& path) :
@@ -41,3 +47,33 @@ public:
     InvalidModeException(const std::string& path) :
         FileSystemException(path, "Invalid mode.") {}
 };
+
+class FileTooLargeException : public FileSystemException {
+public:
+    FileTooLargeException(const std::string& path) :
+        FileSystemException(path, "File too large.") {}
+};
+
+class NoSpaceException : public FileSystemException {
+public:
+    NoSpaceException(const std::string& path) :
+        FileSystemException(path, "File system is full.") {}
+};
+
+class FileInUseException : public FileSystemException {
+public:
+    FileInUseException(const std::string& path) :
+        FileSystemException(path, "File is open.") {}
+};
+
+class UnsupportedFormatException : public FileSystemException {
+public:
+    UnsupportedFormatException(const std::string& path) :
+        FileSystemException(path, "Unsupported file system format.") {}
+};
+
+class CorruptImageException : public FileSystemException {
+public:
+    CorruptImageException(const std::string& path) :
+        FileSystemException(path, "Corrupt file system image.") {}
+};
@@ -1,17 +1,38 @@
 #include "FAT12.h"
 #include "exceptions.h"
+#include "ThreadPool.h"
 #include <iostream>
 #include <filesystem>
+#include <fstream>
 #include <iomanip>
 #include <cmath>
 #include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <sstream>
+#include <queue>
+#include <deque>
+#include <optional>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 using Path = std::filesystem::path;
 
-void errorExit(const char* usage) {
-    std::cerr << "Invalid arguments. Usage: fsutil <fs_path> " << usage << std::endl;
-    std::exit(1);
+// Files are copied in chunks of this size, so memory use does not grow with file size.
+constexpr size_t chunkSize = 64 * 1024;
+
+class UsageException : public std::runtime_error {
+public:
+    UsageException(const std::string& usage) :
+        std::runtime_error("Invalid arguments. Usage: fsutil [options] <fs_path> " + usage) {}
+};
+
+void checkArgumentCount(const std::vector<std::string>& args, size_t count, const char* usage) {
+    if (args.size() < count) {
+        throw UsageException(usage);
+    }
 }
 
 std::string timeToString(int64_t time) {
@@ -22,8 +43,7 @@ std::string timeToString(int64_t time) {
     return oss.str();
 }
 
-int getDigitCount(int size) {
-    assert(size >= 0);
+int getDigitCount(FAT12::FileSize size) {
     if (size == 0) {
         return 1;
     }
@@ -54,37 +74,14 @@ void dir(FAT12& fs, const Path& path) {
     }
 }
 
-void write(FAT12& fs, const Path& dstPath, const Path& srcPath) {
-    // Read external source file.
-    std::ifstream file(srcPath, std::ios::binary | std::ios::ate);
-    assert(file);
-    auto size = file.tellg();
-    std::vector<char> buffer(size);
-    file.seekg(0);
-    file.read(buffer.data(), size);
-
-    // Write to destination file in file system.
-    fs.writeFile(dstPath, buffer);
-
-    // Copy permissions.
-    auto permissions = std::filesystem::status(srcPath).permissions();
+void copyPermissionsToFileSystem(FAT12& fs, const Path& dstPath, std::filesystem::perms permissions) {
     auto attributes = fs.readAttributes(dstPath);
     attributes.canRead = (permissions & std::filesystem::perms::owner_read) != std::filesystem::perms::none;
     attributes.canWrite = (permissions & std::filesystem::perms::owner_write) != std::filesystem::perms::none;
     fs.writeAttributes(dstPath, attributes);
 }
 
-void read(FAT12& fs, const Path& srcPath, const Path& dstPath) {
-    // Read source file from file system.
-    auto buffer = fs.readFile(srcPath);
-
-    // Write to external destination file.
-    std::ofstream file(dstPath, std::ios::binary);
-    assert(file);
-    file.write(buffer.data(), buffer.size());
-
-    // Copy permissions.
-    auto attributes = fs.readAttributes(srcPath);
+void copyPermissionsToHost(const FAT12::FileAttributes& attributes, const Path& dstPath) {
     auto permissions = std::filesystem::perms::none;
     if (attributes.canRead) {
         permissions |= std::filesystem::perms::owner_read;
@@ -95,6 +92,248 @@ void read(FAT12& fs, const Path& srcPath, const Path& dstPath) {
     std::filesystem::permissions(dstPath, permissions);
 }
 
+void write(FAT12& fs, const Path& dstPath, const Path& srcPath, bool append) {
+    // Stream external source file to destination file in file system. An existing file is overwritten over its
+    // own chain and cut to the new length afterwards, so its blocks are reused rather than freed and allocated.
+    std::ifstream file(srcPath, std::ios::binary);
+    assert(file);
+    std::vector<char> buffer(chunkSize);
+
+    auto handle = fs.open(dstPath, true);
+    FAT12::HandleGuard handleGuard(fs, handle);
+    size_t oldSize = fs.size(handle);
+    size_t begin = append ? oldSize : 0;
+    size_t end = begin + std::filesystem::file_size(srcPath);
+
+    // Copy the source bytes that land in [from, to) of the destination.
+    auto copy = [&](size_t from, size_t to) {
+        file.seekg(from - begin);
+        for (size_t offset = from; offset < to; offset += buffer.size()) {
+            size_t length = std::min(buffer.size(), to - offset);
+            file.read(buffer.data(), length);
+            assert((size_t)file.gcount() == length);
+            fs.write(handle, offset, std::span<const char>(buffer.data(), length));
+        }
+    };
+
+    // Only the part past the old end allocates blocks, so it is written first and cut again if the file system
+    // fills up. The existing bytes are overwritten only once it has succeeded.
+    try {
+        copy(std::max(oldSize, begin), end);
+    } catch (const std::exception&) {
+        fs.truncate(handle, oldSize);
+        throw;
+    }
+    copy(begin, std::min(oldSize, end));
+
+    fs.truncate(handle, end);
+    handleGuard.release();
+    fs.close(handle);
+
+    if (!append) {
+        copyPermissionsToFileSystem(fs, dstPath, std::filesystem::status(srcPath).permissions());
+    }
+}
+
+void read(FAT12& fs, const Path& srcPath, const Path& dstPath) {
+    // Check the source before the destination is created, so a failed read leaves an existing destination intact.
+    auto attributes = fs.readAttributes(srcPath);
+    if (attributes.isDirectory) {
+        throw IsADirectoryException(srcPath);
+    }
+    if (!attributes.canRead) {
+        throw PermissionException(srcPath);
+    }
+
+    // Map external destination file at its final size and read source file from file system straight into it.
+    size_t size = attributes.size;
+    int fd = ::open(dstPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+
+    char* mapping = nullptr;
+    if (::ftruncate(fd, size) == 0 && size > 0) {
+        void* address = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        mapping = address == MAP_FAILED ? nullptr : (char*)address;
+    }
+    auto release = [&]() {
+        if (mapping) {
+            ::munmap(mapping, size);
+        }
+        ::close(fd);
+    };
+    if (!mapping && size > 0) {
+        release();
+        throw std::system_error(errno, std::generic_category(), "Mapping " + dstPath.string() + " failed");
+    }
+
+    // An empty file is still read, for the checks of the source path.
+    try {
+        fs.readFile(srcPath, std::span<char>(mapping, size));
+    } catch (...) {
+        release();
+        throw;
+    }
+    release();
+
+    copyPermissionsToHost(fs.readAttributes(srcPath), dstPath);
+}
+
+// Defers write-back of everything done while it is alive. end flushes on success; a batch left by an exception
+// ends without throwing a failed flush over the error on its way.
+class Batch {
+public:
+    Batch(FAT12& fs) : fs(fs) { fs.beginBatch(); }
+    ~Batch() {
+        if (!ended) {
+            try {
+                fs.endBatch();
+            } catch (const std::exception&) {
+            }
+        }
+    }
+
+    void end() {
+        ended = true;
+        fs.endBatch();
+    }
+private:
+    FAT12& fs;
+    bool ended = false;
+};
+
+void createDirectoryIfMissing(FAT12& fs, const Path& path) {
+    try {
+        fs.createDirectory(path);
+    } catch (const FileExistsException& e) {
+        if (!fs.readAttributes(path).isDirectory) {
+            throw;
+        }
+    }
+}
+
+std::vector<char> readHostFile(const Path& path) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    assert(file);
+    std::vector<char> buffer(file.tellg());
+    file.seekg(0);
+    file.read(buffer.data(), buffer.size());
+    return buffer;
+}
+
+void writeHostFile(const Path& path, const std::vector<char>& buffer) {
+    std::ofstream file(path, std::ios::binary);
+    assert(file);
+    file.write(buffer.data(), buffer.size());
+}
+
+void importTree(FAT12& fs, const Path& srcPath, const Path& dstPath) {
+    // Host files are read on the pool while the file system is updated on this thread.
+    ThreadPool pool;
+    size_t window = 4 * pool.size();
+    Batch batch(fs);
+
+    createDirectoryIfMissing(fs, dstPath);
+    std::queue<std::pair<Path, Path>> directories;
+    directories.push({srcPath, dstPath});
+
+    while (!directories.empty()) {
+        auto [srcDirectory, dstDirectory] = directories.front();
+        directories.pop();
+
+        std::vector<std::filesystem::directory_entry> entries(std::filesystem::directory_iterator(srcDirectory), {});
+        std::sort(entries.begin(), entries.end());
+
+        std::deque<std::pair<std::filesystem::directory_entry, std::future<std::vector<char>>>> pending;
+        auto writeNext = [&]() {
+            auto& [entry, data] = pending.front();
+            Path path = dstDirectory/entry.path().filename();
+            fs.writeFile(path, data.get());
+            copyPermissionsToFileSystem(fs, path, entry.status().permissions());
+            pending.pop_front();
+        };
+
+        for (auto& entry : entries) {
+            if (entry.is_directory()) {
+                createDirectoryIfMissing(fs, dstDirectory/entry.path().filename());
+                directories.push({entry.path(), dstDirectory/entry.path().filename()});
+            } else if (entry.is_regular_file()) {
+                pending.push_back({entry, pool.submit([path = entry.path()]() { return readHostFile(path); })});
+                if (pending.size() >= window) {
+                    writeNext();
+                }
+            }
+        }
+
+        while (!pending.empty()) {
+            writeNext();
+        }
+
+        // Persist the directory and the FAT once for all of its files.
+        fs.flush();
+    }
+
+    batch.end();
+}
+
+void exportTree(FAT12& fs, const Path& srcPath, const Path& dstPath) {
+    // Files are read from the file system in parallel groups while host files are written on the pool.
+    ThreadPool pool;
+    size_t window = 4 * pool.size();
+    std::deque<std::future<void>> pending;
+
+    if (!fs.readAttributes(srcPath).isDirectory) {
+        throw NotADirectoryException(srcPath);
+    }
+
+    std::filesystem::create_directories(dstPath);
+    std::queue<std::pair<Path, Path>> directories;
+    directories.push({srcPath, dstPath});
+
+    while (!directories.empty()) {
+        auto [srcDirectory, dstDirectory] = directories.front();
+        directories.pop();
+
+        std::vector<FAT12::FileAttributes> files;
+        for (auto& attributes : fs.listDirectory(srcDirectory)) {
+            if (attributes.isDirectory) {
+                std::filesystem::create_directory(dstDirectory/attributes.name);
+                directories.push({srcDirectory/attributes.name, dstDirectory/attributes.name});
+            } else {
+                files.push_back(attributes);
+            }
+        }
+
+        for (size_t begin = 0; begin < files.size(); begin += window) {
+            size_t end = std::min(begin + window, files.size());
+
+            std::vector<Path> paths;
+            for (size_t i = begin; i < end; i++) {
+                paths.push_back(srcDirectory/files[i].name);
+            }
+            auto contents = fs.readFiles(paths, pool);
+
+            for (size_t i = begin; i < end; i++) {
+                Path dst = dstDirectory/files[i].name;
+                pending.push_back(pool.submit([dst, attributes = files[i], data = std::move(contents[i - begin])]() {
+                    writeHostFile(dst, data);
+                    copyPermissionsToHost(attributes, dst);
+                }));
+            }
+
+            // Bound the number of files held in memory.
+            while (pending.size() > window) {
+                pending.front().get();
+                pending.pop_front();
+            }
+        }
+    }
+
+    while (!pending.empty()) {
+        pending.front().get();
+        pending.pop_front();
+    }
+}
+
 void chmod(FAT12& fs, const Path& path, const std::string& permissions) {
     auto attributes = fs.readAttributes(path);
 
@@ -132,75 +371,277 @@ std::string normalizePath(std::string path) {
     return path;
 }
 
-int main(int argc, char* argv[]) {
-    if (argc < 3) {
-        std::cerr << "Not enough arguments." << std::endl;
-        return 1;
+void runCommand(FAT12& fs, const std::vector<std::string>& args) {
+    if (args[0] == "mkdir") {
+        checkArgumentCount(args, 2, "mkdir <dir_path>");
+        fs.createDirectory(normalizePath(args[1]));
     }
+    else if (args[0] == "dir") {
+        checkArgumentCount(args, 2, "dir <dir_path>");
+        dir(fs, normalizePath(args[1]));
+    }
+    else if (args[0] == "rmdir") {
+        checkArgumentCount(args, 2, "rmdir <dir_path>");
+        fs.deleteDirectory(normalizePath(args[1]));
+    }
+    else if (args[0] == "write") {
+        checkArgumentCount(args, 3, "write <dst_path> <src_path>");
+        write(fs, normalizePath(args[1]), normalizePath(args[2]), false);
+    }
+    else if (args[0] == "append") {
+        checkArgumentCount(args, 3, "append <dst_path> <src_path>");
+        write(fs, normalizePath(args[1]), normalizePath(args[2]), true);
+    }
+    else if (args[0] == "read") {
+        checkArgumentCount(args, 3, "read <src_path> <dst_path>");
+        read(fs, normalizePath(args[1]), normalizePath(args[2]));
+    }
+    else if (args[0] == "del") {
+        checkArgumentCount(args, 2, "del <file_path>");
+        fs.deleteFile(normalizePath(args[1]));
+    }
+    else if (args[0] == "chmod") {
+        checkArgumentCount(args, 3, "chmod <permissions> <path>");
+        chmod(fs, normalizePath(args[2]), args[1]);
+    }
+    else if (args[0] == "import") {
+        checkArgumentCount(args, 3, "import <host_dir> <fs_dir>");
+        importTree(fs, normalizePath(args[1]), normalizePath(args[2]));
+    }
+    else if (args[0] == "export") {
+        checkArgumentCount(args, 3, "export <fs_dir> <host_dir>");
+        exportTree(fs, normalizePath(args[1]), normalizePath(args[2]));
+    }
+    else if (args[0] == "dumpfs") {
+        std::cout << fs.dump();
+    }
+    else if (args[0] == "defrag") {
+        const char* usage = "defrag [--max-blocks <count>] [path]";
+        size_t maxBlockCount = SIZE_MAX;
+        std::string path = "/";
+        for (size_t i = 1; i < args.size(); i++) {
+            if (args[i] == "--max-blocks") {
+                if (++i == args.size() || args[i].empty() || args[i].find_first_not_of("0123456789") != std::string::npos) {
+                    throw UsageException(usage);
+                }
+                maxBlockCount = std::stoull(args[i]);
+            } else {
+                path = args[i];
+            }
+        }
 
-    FAT12 fs(argv[1]);
+        auto report = fs.defragment(normalizePath(path), maxBlockCount);
+        std::cout << "Fragmented chains: " << report.fragmentedChainsBefore << " before, " << report.fragmentedChainsAfter << " after, of " << report.chainCount << "\n";
+        std::cout << "Fragments: " << report.fragmentsBefore << " before, " << report.fragmentsAfter << " after\n";
+        std::cout << "Moved " << report.movedBlockCount << " blocks of " << report.movedChainCount << " chains\n";
+    }
+    else if (args[0] == "fsck") {
+        if (args.size() > 1 && args[1] != "--repair") {
+            throw UsageException("fsck [--repair]");
+        }
+        bool repair = args.size() > 1;
+        auto report = fs.check(repair);
+        for (auto& problem : report.problems) {
+            std::cout << problem << "\n";
+        }
+        std::cout << report.fileCount << " files, " << report.directoryCount << " directories, " << report.usedBlockCount << " blocks in use\n";
+        if (!report.problems.empty()) {
+            if (!repair) {
+                throw std::runtime_error("File system has " + std::to_string(report.problems.size()) + " problems.");
+            }
+            std::cout << "Repaired " << report.problems.size() << " problems\n";
+        }
+    }
+    else {
+        throw std::runtime_error("Invalid subcommand.");
+    }
+}
 
-    try {
-        if (std::string(argv[2]) == "mkdir") {
-            if (argc < 4) {
-                errorExit("mkdir <dir_path>");
+// Splits a batch line into commands of words. Double quotes group words containing spaces. With semicolons, an
+// unquoted semicolon ends a command, so a line may hold several.
+std::vector<std::vector<std::string>> splitCommand(const std::string& line, bool semicolons) {
+    std::vector<std::vector<std::string>> commands(1);
+    std::string word;
+    bool inWord = false;
+    bool quoted = false;
+
+    for (char c : line) {
+        bool separator = c == ';' && semicolons && !quoted;
+        if (c == '"') {
+            quoted = !quoted;
+            inWord = true;
+        } else if ((std::isspace((unsigned char)c) || separator) && !quoted) {
+            if (inWord) {
+                commands.back().push_back(word);
+                word.clear();
+                inWord = false;
             }
-        
-            fs.createDirectory(normalizePath(argv[3]));
+            if (separator) {
+                commands.emplace_back();
+            }
+        } else {
+            word += c;
+            inWord = true;
         }
-        else if (std::string(argv[2]) == "dir") {
-            if (argc < 4) {
-                errorExit("dir <dir_path>");
+    }
+
+    if (inWord) {
+        commands.back().push_back(word);
+    }
+
+    return commands;
+}
+
+// Runs one subcommand per line against a single open file system. Blocks are written back at "sync" lines and at the end.
+// Stops at the first failing line. With semicolons, each command after a semicolon is numbered as a line of its own.
+void runBatch(FAT12& fs, std::istream& script, bool time, Trace* trace, bool semicolons = false) {
+    std::string line;
+    int lineNumber = 0;
+
+    Batch batch(fs);
+
+    while (std::getline(script, line)) {
+        for (auto& args : splitCommand(line, semicolons)) {
+            lineNumber++;
+
+            if (args.empty() || args[0].starts_with("#")) {
+                continue;
             }
 
-            dir(fs, normalizePath(argv[3]));
-        }
-        else if (std::string(argv[2]) == "rmdir") {
-            if (argc < 4) {
-                errorExit("rmdir <dir_path>");
+            auto start = std::chrono::steady_clock::now();
+
+            try {
+                if (args[0] == "sync") {
+                    fs.flush();
+                } else {
+                    runCommand(fs, args);
+                }
+            } catch (const std::exception& e) {
+                throw std::runtime_error("line " + std::to_string(lineNumber) + ": " + e.what());
             }
 
-            fs.deleteDirectory(normalizePath(argv[3]));
-        }
-        else if (std::string(argv[2]) == "write") {
-            if (argc < 5) {
-                errorExit("write <dst_path> <src_path>");
+            auto end = std::chrono::steady_clock::now();
+            if (trace) {
+                trace->record(args[0], start, end);
             }
 
-            write(fs, normalizePath(argv[3]), normalizePath(argv[4]));
-        }
-        else if (std::string(argv[2]) == "read") {
-            if (argc < 5) {
-                errorExit("read <src_path> <dst_path>");
+            if (time) {
+                std::chrono::duration<double, std::micro> elapsed = end - start;
+                std::cerr << "time\t" << lineNumber << "\t" << args[0] << "\t" << elapsed.count() << " us" << std::endl;
             }
-            
-            read(fs, normalizePath(argv[3]), normalizePath(argv[4]));
         }
-        else if (std::string(argv[2]) == "del") {
-            if (argc < 4) {
-                errorExit("del <file_path>");
-            }
+    }
+
+    batch.end();
+}
+
+void printCallStats(const std::string& name, const CallStats& stats) {
+    std::chrono::duration<double, std::micro> time = stats.time;
+    std::cerr << "stats\t" << name << "\t" << stats.calls << " calls\t" << time.count() << " us" << std::endl;
+}
 
-            fs.deleteFile(normalizePath(argv[3]));
+// Prints the file system counters to stderr, one per line.
+void printStats(const FAT12::Stats& stats) {
+    printCallStats("disk.read", stats.disk.reads);
+    printCallStats("disk.write", stats.disk.writes);
+    printCallStats("disk.advise", stats.disk.advises);
+    std::cerr << "stats\tdisk.sectorsRead\t" << stats.disk.sectorsRead << std::endl;
+    std::cerr << "stats\tdisk.sectorsWritten\t" << stats.disk.sectorsWritten << std::endl;
+    std::cerr << "stats\tcache.hits\t" << stats.cache.hits << std::endl;
+    std::cerr << "stats\tcache.misses\t" << stats.cache.misses << std::endl;
+    std::cerr << "stats\tcache.evictions\t" << stats.cache.evictions << std::endl;
+    std::cerr << "stats\tcache.writebacks\t" << stats.cache.writebacks << std::endl;
+    printCallStats("readBlock", stats.readBlock);
+    printCallStats("writeBlock", stats.writeBlock);
+    printCallStats("writeFat", stats.writeFat);
+    printCallStats("readDirectory", stats.readDirectory);
+    printCallStats("writeDirectory", stats.writeDirectory);
+    printCallStats("pathToAddressAndSize", stats.pathToAddressAndSize);
+}
+
+int main(int argc, char* argv[]) {
+    auto backend = Disk::Backend::File;
+    bool time = false;
+    bool stats = false;
+    std::string tracePath;
+
+    // Options come before the file system path.
+    int first = 1;
+    for (; first < argc && std::string(argv[first]).starts_with("--"); first++) {
+        if (std::string(argv[first]) == "--mmap") {
+            backend = Disk::Backend::Mapped;
+        } else if (std::string(argv[first]) == "--time") {
+            time = true;
+        } else if (std::string(argv[first]) == "--stats") {
+            stats = true;
+        } else if (std::string(argv[first]) == "--trace" && first + 1 < argc) {
+            tracePath = argv[++first];
+        } else {
+            std::cerr << "Invalid option: " << argv[first] << std::endl;
+            return 1;
         }
-        else if (std::string(argv[2]) == "chmod") {
-            if (argc < 5) {
-                errorExit("chmod <permissions> <path>");
-            }
+    }
+
+    if (argc - first < 2) {
+        std::cerr << "Not enough arguments." << std::endl;
+        return 1;
+    }
+
+    // Declared before the file system, which may still flush while it is destroyed.
+    Trace trace;
+    Trace* tracePointer = tracePath.empty() ? nullptr : &trace;
 
-            chmod(fs, normalizePath(argv[4]), argv[3]);
+    std::optional<FAT12> fileSystem;
+    try {
+        fileSystem.emplace(argv[first], backend);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    FAT12& fs = *fileSystem;
+    fs.setTrace(tracePointer);
+    std::vector<std::string> args(argv + first + 1, argv + argc);
+    int status = 0;
+
+    try {
+        if (args[0] == "batch") {
+            runBatch(fs, std::cin, time, tracePointer);
         }
-        else if (std::string(argv[2]) == "dumpfs") {
-            std::cout << fs.dump();
+        else if (args[0] == "-c") {
+            checkArgumentCount(args, 2, "-c \"<command>; <command>...\"");
+
+            // Commands are separated by semicolons outside quotes.
+            std::istringstream script(args[1]);
+            runBatch(fs, script, time, tracePointer, true);
         }
         else {
-            std::cerr << "Invalid subcommand." << std::endl;
-            return 1;
+            auto start = std::chrono::steady_clock::now();
+            runCommand(fs, args);
+            if (tracePointer) {
+                trace.record(args[0], start, std::chrono::steady_clock::now());
+            }
         }
+
+        // Reports a flush that failed when a command returned.
+        fs.flush();
     } catch (const std::exception& e) {
         std::cerr << e.what() << std::endl;
-        return 1;
+        status = 1;
+    }
+
+    if (stats) {
+        printStats(fs.stats());
+    }
+
+    if (tracePointer) {
+        std::ofstream out(tracePath);
+        trace.write(out);
+        if (!out) {
+            std::cerr << "Could not write trace to " << tracePath << std::endl;
+            status = 1;
+        }
     }
 
-    return 0;
+    return status;
 }
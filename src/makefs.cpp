@@ -2,17 +2,50 @@
 #include <iostream>
 
 void errorExit() {
-    std::cerr << "Invalid arguments. Usage: makefs <fs_path> <block_size(512|1024|2048|4096)>" << std::endl;
+    std::cerr << "Invalid arguments. Usage: makefs <fs_path> <block_size(512|1024|2048|4096)> [image_size[K|M|G]]" << std::endl;
     std::exit(1);
 }
 
+// Parses a byte count with an optional binary K, M or G suffix. Returns 0 if it is not valid.
+size_t parseSize(const std::string& text) {
+    size_t length = 0;
+    size_t size;
+    try {
+        size = std::stoull(text, &length);
+    } catch (const std::exception&) {
+        return 0;
+    }
+
+    std::string suffix = text.substr(length);
+    int shift = suffix == "" ? 0 : suffix == "K" ? 10 : suffix == "M" ? 20 : suffix == "G" ? 30 : -1;
+    if (shift < 0 || size > (SIZE_MAX >> shift)) {
+        return 0;
+    }
+
+    return size << shift;
+}
+
 int main(int argc, char* argv[]) {
+    if (argc < 3 || argc > 4) {
+        errorExit();
+    }
+
     std::string blockSize = argv[2];
-    if (argc < 3 || blockSize != "512" && blockSize != "1024" && blockSize != "2048" && blockSize != "4096") {
+    if (blockSize != "512" && blockSize != "1024" && blockSize != "2048" && blockSize != "4096") {
         errorExit();
     }
 
-    FAT12 fat12(argv[1], std::atoi(blockSize.c_str()));
+    // The image size determines the block count and so the FAT length.
+    size_t blockCount = FAT12::defaultBlockCount;
+    if (argc == 4) {
+        blockCount = parseSize(argv[3]) / std::atoi(blockSize.c_str());
+        if (blockCount < FAT12::minBlockCount || blockCount > FAT12::maxBlockCount) {
+            std::cerr << "Image size must be between " << FAT12::minBlockCount << " and " << FAT12::maxBlockCount << " blocks." << std::endl;
+            std::exit(1);
+        }
+    }
+
+    FAT12 fat12(argv[1], std::atoi(blockSize.c_str()), blockCount);
 
     return 0;
 }